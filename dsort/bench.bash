@@ -0,0 +1,145 @@
+#!/bin/bash
+# Benchmarks dsort against the reference pipeline in dsort.bash.
+#
+# Generates synthetic datasets, runs both programs on each of them, checks
+# that their output is identical and appends throughput and peak memory to
+# bench/results.csv. The dataset matrix can be narrowed or widened with
+# BENCH_LINES, BENCH_LENGTHS, BENCH_DUPS and BENCH_SORTED (space separated).
+
+set -u
+
+cd "$(dirname "$0")"
+
+# The reference pipeline has to sort bytes like dsort does
+export LC_ALL=C
+
+LINES=${BENCH_LINES:-"100000 1000000"}
+LENGTHS=${BENCH_LENGTHS:-"16 100"}
+# Fraction of lines which repeat an earlier line
+DUPS=${BENCH_DUPS:-"0.1 0.9"}
+# Fraction of lines in sorted position, 0 is random order
+SORTED=${BENCH_SORTED:-"0 0.99 1"}
+
+DIR=bench
+DATA=$DIR/data
+RESULTS=$DIR/results.csv
+mkdir -p "$DATA"
+
+if [ ! -f "$RESULTS" ]; then
+  echo "date,revision,dataset,lines,length,dup_ratio,sortedness,bytes,program,seconds,mb_per_s,peak_rss_kib,identical" > "$RESULTS"
+fi
+
+DATE=$(date -u +%Y-%m-%dT%H:%M:%SZ)
+REVISION=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+
+if [ -x /usr/bin/time ]; then
+  HAVE_TIME=1
+else
+  HAVE_TIME=0
+  echo "/usr/bin/time not found, peak memory of dsort.bash will be NA" >&2
+fi
+
+# generate <file> <lines> <length> <dup ratio> <sortedness> <seed>
+generate() {
+  awk -v n="$2" -v len="$3" -v dup="$4" -v sorted="$5" -v seed="$6" 'BEGIN {
+    srand(seed)
+    distinct = int(n * (1 - dup))
+    if (distinct < 1) {
+      distinct = 1
+    }
+    # A few shared prefixes, like paths or log keys
+    filler = "/srv/data/logs/service/instance/component/"
+    while (length(filler) < len) {
+      filler = filler filler
+    }
+    for (i = 0; i < n; i++) {
+      key = int(rand() * distinct)
+      id = sprintf("%08x", key * 2654435761 % 4294967296)
+      pad = len - length(id)
+      if (pad < 0) {
+        pad = 0
+      }
+      print substr(filler, 1 + key % 7, pad) id
+    }
+  }' | if [ "$5" = "0" ]; then
+    cat
+  else
+    sort | awk -v sorted="$5" -v seed="$6" 'BEGIN { srand(seed) }
+      { line[NR] = $0 }
+      END {
+        # Move the unsorted fraction of lines to random positions
+        for (i = 1; i <= NR; i++) {
+          if (rand() >= sorted) {
+            j = 1 + int(rand() * NR)
+            t = line[i]; line[i] = line[j]; line[j] = t
+          }
+        }
+        for (i = 1; i <= NR; i++) {
+          print line[i]
+        }
+      }'
+  fi > "$1"
+}
+
+# measure <csv prefix> <program name> <output file> <command...>
+# Prints the CSV line for one run.
+measure() {
+  local prefix=$1 name=$2 output=$3
+  shift 3
+  local start end seconds rss
+  if [ "$name" = "dsort" ]; then
+    start=$(date +%s.%N)
+    "$@" --stats=json > "$output" 2> "$DIR/stats.json"
+    end=$(date +%s.%N)
+    rss=$(sed -n 's/.*"peak_rss_kib":\([0-9]*\).*/\1/p' "$DIR/stats.json")
+  elif [ "$HAVE_TIME" = 1 ]; then
+    start=$(date +%s.%N)
+    /usr/bin/time -f %M -o "$DIR/time.txt" "$@" > "$output"
+    end=$(date +%s.%N)
+    rss=$(tail -n 1 "$DIR/time.txt")
+  else
+    start=$(date +%s.%N)
+    "$@" > "$output"
+    end=$(date +%s.%N)
+    rss=NA
+  fi
+  awk -v start="$start" -v end="$end" -v bytes="$BYTES" -v prefix="$prefix" -v name="$name" -v rss="$rss" \
+    'BEGIN { s = end - start; printf "%s,%s,%.3f,%.1f,%s\n", prefix, name, s, bytes / 1048576 / s, rss }'
+}
+
+status=0
+for lines in $LINES; do
+  for length in $LENGTHS; do
+    for dup in $DUPS; do
+      for sorted in $SORTED; do
+        name="n${lines}_l${length}_d${dup}_s${sorted}"
+        one="$DATA/$name.1"
+        two="$DATA/$name.2"
+        if [ ! -f "$one" ] || [ ! -f "$two" ]; then
+          generate "$one" $((lines / 2)) "$length" "$dup" "$sorted" 1
+          generate "$two" $((lines - lines / 2)) "$length" "$dup" "$sorted" 2
+        fi
+        BYTES=$(cat "$one" "$two" | wc -c)
+        prefix="$DATE,$REVISION,$name,$lines,$length,$dup,$sorted,$BYTES"
+
+        dsortLine=$(measure "$prefix" dsort "$DIR/dsort.out" ./dsort "cat $one" "cat $two")
+        referenceLine=$(measure "$prefix" dsort.bash "$DIR/reference.out" ./dsort.bash "cat $one" "cat $two")
+
+        if cmp -s "$DIR/dsort.out" "$DIR/reference.out"; then
+          identical=yes
+        else
+          identical=no
+          status=1
+          echo "$name: output differs from dsort.bash" >&2
+        fi
+        echo "$dsortLine,$identical" >> "$RESULTS"
+        echo "$referenceLine,$identical" >> "$RESULTS"
+        echo "$dsortLine,$identical"
+        echo "$referenceLine,$identical"
+      done
+    done
+  done
+done
+
+rm -f "$DIR/dsort.out" "$DIR/reference.out" "$DIR/stats.json" "$DIR/time.txt"
+exit $status
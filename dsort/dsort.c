@@ -11,27 +11,602 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/wait.h>
 #include <assert.h>
 #include <ctype.h>
 #include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+/// SSE2 and AVX2 newline scanning is available
+#define HAVE_X86_SIMD 1
+#endif
 
 /// Name of this program
 static const char *programName = "dsort";
 
+/// Bit in a line's source mask for the command with the given index (0 or 1)
+#define SOURCE_BIT(source) (1u << (source))
+
+/// Source mask of a line that was printed by both commands
+#define SOURCE_BOTH (SOURCE_BIT(0) | SOURCE_BIT(1))
+
+/// Initial number of slots in a LineTable, must be a power of two
+#define LINE_TABLE_INITIAL_CAPACITY (1024)
+
+/// Bytes read from a command at once, also the default chunk size
+#define CHUNK_SIZE (1024 * 1024)
+
+/// Bytes of output copied before they are written
+#define OUTPUT_BUFFER_SIZE (256 * 1024)
+
+/// Slices written by one writev(), at most IOV_MAX
+#define OUTPUT_SLICES (1024)
+
+/// Shorter lines are copied, below a page a slice costs more than the copy
+#define OUTPUT_SLICE_MIN (4096)
+
+/// Bytes a reader thread fills before handing them to the parser threads
+#define PIPELINE_BLOCK_SIZE (4 * 1024 * 1024)
+
+/// Most parser threads
+#define PIPELINE_MAX_PARSERS (8)
+
+/// Largest arena, every byte has to be addressable by a 32 bit offset
+#define ARENA_MAX_SIZE ((size_t) UINT32_MAX + 1)
+
+/// Smallest arena worth trying if the address space is limited
+#define ARENA_MIN_SIZE ((size_t) 64 * 1024 * 1024)
+
+/// Bytes per block of the Bloom filter, one cache line
+#define BLOOM_BLOCK_SIZE (64)
+
+/// Bits per block of the Bloom filter
+#define BLOOM_BLOCK_BITS (BLOOM_BLOCK_SIZE * 8)
+
+/// Default memory budget of the Bloom filter in bytes (-m)
+#define BLOOM_DEFAULT_BUDGET (64UL * 1024 * 1024)
+
+/// Default false positive rate of the Bloom filter (-e)
+#define BLOOM_DEFAULT_RATE (0.01)
+
+/// Upper bound for the number of bits set per line
+#define BLOOM_MAX_HASHES (16)
+
+/**
+ * A line of output, not NUL terminated and without its newline
+ *
+ * 8 bytes: lines are sorted by permuting these, not the bytes in the arena.
+ */
+typedef struct {
+  /// Offset of the first byte of the line in the arena
+  uint32_t offset;
+  /// Number of bytes in the line
+  uint32_t length;
+} Line;
+
+/**
+ * One mmap()ed region holding the bytes of all kept lines. The region is
+ * reserved up front so it never moves, pages are only backed once touched,
+ * with transparent huge pages where the kernel allows it.
+ */
+static struct {
+  /// The first byte of the region
+  char *base;
+  /// Bytes in use
+  size_t used;
+  /// Size of the region
+  size_t size;
+} arena;
+
+/// The lines slotCmp compares, qsort has no context argument
+static Line *slotCmpLines;
+
+/**
+ * The ordering requested with -k, -n and -f. Only the order of the output
+ * changes, lines are still duplicates only if they are equal.
+ */
+static struct {
+  /// 1 if any of the options was given
+  int enabled;
+  /// Field the key starts in, counted from 1
+  unsigned int startField;
+  /// Character of startField the key starts at, counted from 1
+  unsigned int startChar;
+  /// Field the key ends in, 0 for the end of the line
+  unsigned int endField;
+  /// Last character of the key in endField, 0 for the end of the field
+  unsigned int endChar;
+  /// -n: compare the leading number of the key
+  int numeric;
+  /// -f: compare the key as if upper case
+  int fold;
+} sortKey = { 0, 1, 1, 0, 0, 0, 0 };
+
+/**
+ * A line with its sort key, extracted once before sorting.
+ *
+ * Most comparisons are decided by the prefix alone: the number in an order
+ * preserving encoding for -n, otherwise the first 8 bytes of the (folded)
+ * key, big endian. The rest of a textual key is read from the arena.
+ */
+typedef struct {
+  /// The key's order preserving 64 bit prefix
+  uint64_t prefix;
+  /// Offset of the key in the arena
+  uint32_t keyOffset;
+  /// Number of bytes in the key, 0 for -n
+  uint32_t keyLength;
+  /// Index of the line in keyCmpLines
+  uint32_t line;
+} KeyedLine;
+
+/// The lines keyCmp breaks ties with, qsort has no context argument
+static Line *keyCmpLines;
+
+/**
+ * Finds all newlines in a block of data
+ *
+ * @param data The data to scan
+ * @param length Number of bytes in data, at most CHUNK_SIZE
+ * @param positions Receives the offset of every newline, in order
+ *
+ * @return The number of newlines found
+ */
+typedef size_t (*NewlineFinder)(const char *data, size_t length, uint32_t *positions);
+
+/**
+ * Receives a line read by readLines()
+ *
+ * @param context The context given to readLines()
+ * @param data The line, in the arena if read in place, otherwise only
+ * valid during the call
+ * @param length Number of bytes in the line, without the newline
+ * @param source The index of the command which printed the line
+ */
+typedef void (*LineSink)(void *context, const char *data, size_t length, unsigned int source);
+
+/// Value of --stats in the long options, outside the range of short options
+#define OPTION_STATS (256)
+
+/// getopt_long() value of --watch
+#define OPTION_WATCH (257)
+
+/// The phases --stats reports on
+typedef enum {
+  /// Creating the pipes and processes of the commands and waiting for them
+  PHASE_SPAWN,
+  /// Reading, indexing and collecting the output of the commands
+  PHASE_READ,
+  /// Sorting lines
+  PHASE_SORT,
+  /// Finding duplicates in the sorted lines or confirming candidates
+  PHASE_DEDUP,
+  /// Printing the result
+  PHASE_OUTPUT,
+  /// Number of phases
+  PHASE_COUNT
+} Phase;
+
+/**
+ * Everything dsort prints to stdout, bypassing stdio.
+ *
+ * Output is gathered as slices and written with one writev() per batch.
+ * Long lines which stay in the arena until the batch is written are
+ * referenced where they are. Everything else, like short and decoded lines,
+ * counts and newlines, is copied into a page aligned buffer the slices
+ * point into.
+ */
+static struct {
+  /// The buffer, OUTPUT_BUFFER_SIZE bytes
+  char *buffer;
+  /// Bytes in buffer
+  size_t used;
+  /// The slices of the next writev()
+  struct iovec slices[OUTPUT_SLICES];
+  /// Number of slices
+  int slicesCount;
+} output;
+
+/// Names of the phases in the --stats report
+static const char *phaseNames[PHASE_COUNT] = { "spawn", "read", "sort", "dedup", "output" };
+
+/**
+ * Figures collected for --stats
+ */
+static struct {
+  /// Wall clock time spent in each phase in seconds
+  double wall[PHASE_COUNT];
+  /// CPU time of dsort itself spent in each phase in seconds
+  double cpu[PHASE_COUNT];
+  /// Wall clock time the running phases started at
+  double wallStarted[PHASE_COUNT];
+  /// CPU time the running phases started at
+  double cpuStarted[PHASE_COUNT];
+  /// Bytes read from each command
+  uint64_t bytes[2];
+  /// Lines read from each command
+  uint64_t lines[2];
+  /// Number of allocations and reallocations
+  uint64_t allocations;
+  /// Bytes requested by those
+  uint64_t allocatedBytes;
+  /// Bytes of the sorted lines before front coding, 0 if not used
+  uint64_t uncodedBytes;
+  /// Bytes of the sorted lines after front coding
+  uint64_t codedBytes;
+} stats;
+
+/// What dsort should print
+typedef enum {
+  /// Lines printed more than once (sort | uniq -d), the default
+  MODE_DUPLICATES,
+  /// Distinct lines printed by both commands
+  MODE_INTERSECT,
+  /// Distinct lines printed by command1 but not by command2
+  MODE_SUBTRACT,
+  /// Every distinct line printed by any of the commands
+  MODE_UNION,
+  /// Lines printed more than once, prefixed by their count (uniq -dc)
+  MODE_COUNT
+} Mode;
+
+/**
+ * A slot in the open addressing hash table of a LineTable
+ *
+ * 16 bytes per distinct line: the 64 bit fingerprint, the index of the one
+ * representative copy of the line and the number of times it was seen.
+ */
+typedef struct {
+  /// The 64 bit fingerprint of the line
+  uint64_t hash;
+  /// Index of the line in the lines array plus one, 0 marks a free slot
+  uint32_t line;
+  /// Number of times the line was printed by any command
+  uint32_t count;
+} LineSlot;
+
+/**
+ * Hash table over the distinct lines collected so far.
+ *
+ * Used by the set operation and count modes to join the output of both
+ * commands in linear time. Only the first occurrence of a line is kept in
+ * the lines array, every further occurrence just adds its command to the
+ * source mask and increments the count.
+ */
+typedef struct {
+  /// The slots, linear probing
+  LineSlot *slots;
+  /// Number of slots, always a power of two
+  size_t capacity;
+  /// Number of occupied slots
+  size_t used;
+  /// Source mask (SOURCE_BIT) of every distinct line, indexed like lines
+  uint8_t *sources;
+  /// Number of elements sources has room for
+  size_t sourcesCapacity;
+} LineTable;
+
+/**
+ * Blocked Bloom filter over line hashes.
+ *
+ * All bits of a line live in one cache line sized block, so testing and
+ * adding a line touches a single cache line no matter how many bits are
+ * set per line.
+ */
+typedef struct {
+  /// The blocks, mmap()ed so untouched blocks cost no memory
+  uint64_t (*blocks)[BLOOM_BLOCK_SIZE / sizeof(uint64_t)];
+  /// Number of blocks
+  size_t blocksCount;
+  /// Number of bits set per line
+  unsigned int hashes;
+  /// Number of distinct lines the filter holds at the requested rate
+  size_t capacity;
+  /// Number of lines added so far
+  size_t added;
+} BloomFilter;
+
+/**
+ * Sorted lines, front-coded: every entry holds the number of bytes the line
+ * shares with the previous one and the number of bytes following those,
+ * both as varints, then the following bytes. Two equal neighbours are
+ * recognizable from the entry header alone.
+ */
+typedef struct {
+  /// The entries
+  uint8_t *data;
+  /// Bytes used in data
+  size_t used;
+  /// Size of data
+  size_t capacity;
+  /// Number of entries
+  unsigned int count;
+  /// Length of the longest line, the size of the decode buffer
+  size_t maxLength;
+} FrontCoded;
+
+/**
+ * Decodes the lines of a FrontCoded one after the other
+ */
+typedef struct {
+  /// The next entry
+  const uint8_t *entry;
+  /// Number of entries not decoded yet
+  unsigned int left;
+  /// The current line, room for the longest one
+  char *line;
+  /// Number of bytes in line, SIZE_MAX before the first line
+  size_t length;
+  /// 1 if the current line equals the one before it
+  int equal;
+} FrontCodedReader;
+
+/**
+ * State kept between the ticks of --watch, indexed like the lines of the
+ * collector
+ */
+typedef struct {
+  /// How often each command printed each distinct line in the last tick
+  uint32_t (*counts)[2];
+  /// The same for the running tick
+  uint32_t (*ticks)[2];
+  /// Number of lines counts and ticks have room for
+  size_t capacity;
+} Watch;
+
+/**
+ * Complete lines read by a reader thread, waiting for a parser thread
+ */
+typedef struct Block {
+  /// The index of the command which printed the lines
+  unsigned int source;
+  /// Position of the block in the output of its command
+  size_t sequence;
+  /// Offset of the first byte in the arena
+  size_t offset;
+  /// Number of bytes, the last line may lack its newline
+  size_t length;
+  /// The next block in the queue
+  struct Block *next;
+} Block;
+
+/**
+ * The lines of a parsed block, sorted
+ */
+typedef struct {
+  /// The lines, NULL once they are front-coded
+  Line *lines;
+  /// Number of lines
+  unsigned int count;
+  /// The lines front-coded, unless a keyed order sorts them all at once
+  FrontCoded coded;
+} Run;
+
+/**
+ * State shared by the reader and parser threads of the default mode.
+ *
+ * A reader thread per command fills blocks of the arena straight from the
+ * pipe and queues the complete lines. Parser threads index the lines of a
+ * block and sort them into a run while the commands are still running,
+ * then front-code the run and hand the block's pages back.
+ */
+typedef struct {
+  /// Guards everything below and arena.used
+  pthread_mutex_t mutex;
+  /// Signalled when a block was queued or the last reader finished
+  pthread_cond_t changed;
+  /// Signalled when a parser took a block
+  pthread_cond_t taken;
+  /// The first queued block
+  Block *head;
+  /// The last queued block
+  Block *tail;
+  /// Number of queued blocks
+  unsigned int queued;
+  /// Readers wait while this many blocks are queued, which bounds the
+  /// bytes held in the arena before they are front-coded
+  unsigned int queueLimit;
+  /// Number of reader threads still running
+  unsigned int readersLeft;
+  /// The runs of each command, indexed by the sequence of their block
+  Run *runs[2];
+  /// Number of elements in runs
+  size_t runsCount[2];
+  /// Number of elements runs has room for
+  size_t runsCapacity[2];
+} Pipeline;
+
+/**
+ * Argument of a reader thread
+ */
+typedef struct {
+  /// The pipeline to feed
+  Pipeline *pipeline;
+  /// The read end of the command's pipe
+  int fd;
+  /// The index of the command
+  unsigned int source;
+} Reader;
+
+/**
+ * Destination of the lines read by getLines()
+ */
+typedef struct {
+  /// The kept lines
+  Line *lines;
+  /// Number of lines in lines
+  unsigned int linesCount;
+  /// Number of lines lines has room for
+  size_t linesCapacity;
+  /// Distinct lines or candidates, NULL to keep every line
+  LineTable *table;
+  /// Approximate mode: only lines passing this filter are kept
+  BloomFilter *filter;
+  /// Approximate mode: every line, for the exact second pass
+  FILE *spool;
+  /// Index of the first line of each command in lines
+  unsigned int sourceStart[2];
+  /// Default mode: the sorted runs, front-coded, instead of lines
+  FrontCoded *runs;
+  /// Number of elements in runs
+  size_t runsCount;
+  /// --watch: count the lines of this tick, needs a table
+  Watch *watch;
+} Collector;
+
 // ******* Function signatures *******
 
-static void getLines(char *command, char ***lines, unsigned int* linesCount);
+static void getLines(char *command, unsigned int source, Collector *collector);
+
+static int spawnCommand(char *command, pid_t *childPid);
+
+static void waitCommand(pid_t childPid, int fd);
+
+static void getLinesPipelined(char *commandOne, char *commandTwo, Collector *collector);
+
+static void *readerMain(void *argument);
+
+static size_t pipelineClaim(Pipeline *pipeline, size_t length);
 
-static void uniq(char **lines, unsigned int linesCount, char ***uniqLines, unsigned int *uniqLinesCount);
+static void pipelinePush(Pipeline *pipeline, unsigned int source, size_t sequence, size_t offset, size_t length);
+
+static void *parserMain(void *argument);
+
+static Run parseBlock(const Block *block, uint32_t *positions);
+
+static void pipelineCollect(Pipeline *pipeline, Collector *collector);
+
+static size_t readLines(int fd, unsigned int source, LineSink sink, void *context);
+
+static void collectLine(void *context, const char *data, size_t length, unsigned int source);
+
+static void confirmLine(void *context, const char *data, size_t length, unsigned int source);
+
+static size_t findNewlinesScalar(const char *data, size_t length, uint32_t *positions);
+
+static NewlineFinder selectNewlineFinder(void);
+
+static void uniq(Line *lines, unsigned int linesCount, Line **uniqLines, unsigned int *uniqLinesCount);
+
+static void frontCode(const Line *lines, unsigned int linesCount, FrontCoded *coded);
+
+static void frontCodeAdd(FrontCoded *coded, const char *previous, size_t previousLength, const char *data, size_t length);
+
+static void frontCodedOpen(const FrontCoded *coded, FrontCodedReader *reader);
+
+static int frontCodedNext(FrontCodedReader *reader);
+
+static void printFrontCoded(const FrontCoded *coded);
+
+static size_t putVarint(uint8_t *target, size_t value);
+
+static size_t getVarint(const uint8_t *source, size_t *value);
+
+static void mergeUniq(const FrontCoded *runs, size_t runsCount, FrontCoded *duplicates);
+
+static void mergeSiftDown(size_t *heap, size_t heapCount, size_t index, const FrontCodedReader *readers);
 
 static void usage(void);
 
-static void recursiveFree(char** lines, unsigned int linesCount);
+static void collectorFree(Collector *collector);
+
+static inline const char *lineData(const Line *line);
+
+static void arenaInit(void);
+
+static uint32_t arenaAppend(const char *data, size_t length);
+
+static void arenaRelease(size_t offset, size_t length);
+
+static void printLine(const Line *line);
+
+static void outputInit(void);
+
+static void outputWrite(const char *data, size_t length);
+
+static void outputSlice(const char *data, size_t length);
+
+static void outputAdd(const char *data, size_t length);
+
+static void outputFlush(void);
+
+static void *xmalloc(size_t size);
+
+static void *xrealloc(void *pointer, size_t size);
+
+static void *xcalloc(size_t count, size_t size);
+
+static void phaseStart(Phase phase);
+
+static void phaseStop(Phase phase);
+
+static void printStats(int json);
 
 static int stringCmp(const void *a, const void *b);
 
+static int bytesCmp(const char *a, size_t aLength, const char *b, size_t bLength);
+
+static size_t commonPrefix(const char *a, const char *b, size_t limit);
+
+static uint64_t hashLine(const char *data, size_t length);
+
+static void tableInit(LineTable *table);
+
+static int tableAdd(LineTable *table, Line *lines, unsigned int linesCount, const char *data, size_t length, uint64_t hash, unsigned int source);
+
+static LineSlot *tableFind(LineTable *table, Line *lines, const char *data, size_t length, uint64_t hash);
+
+static void tableFree(LineTable *table);
+
+static int modeMatches(Mode mode, uint8_t sources);
+
+static void printDuplicates(LineTable *table, Line *lines, int showCounts);
+
+static void bloomInit(BloomFilter *filter, size_t budget, double rate);
+
+static int bloomAdd(BloomFilter *filter, uint64_t hash);
+
+static void bloomFree(BloomFilter *filter);
+
+static void confirmCandidates(Collector *collector);
+
+static size_t parseSize(const char *size);
+
+static void watch(char *commandOne, char *commandTwo, Mode mode, double interval, int statsFormat);
+
+static int watchMember(Mode mode, const uint32_t counts[2]);
+
+static void watchApply(Collector *collector, Mode mode);
+
+static void watchCompact(Collector *collector);
+
+static int slotCmp(const void *a, const void *b);
+
+static int parseKey(const char *key);
+
+static void sortKeyed(Line *lines, unsigned int linesCount, uint32_t *order);
+
+static KeyedLine makeKey(const Line *line, uint32_t index);
+
+static size_t skipField(const char *data, size_t length, size_t position);
+
+static int keyCmp(const void *a, const void *b);
+
 // ******* End Function signatures *******
 
+/// The newline scanner used by readLines(), the fastest this CPU supports
+static NewlineFinder findNewlines = findNewlinesScalar;
+
 /** The starting point of the program
  *
  * @param argc the number of arguments
@@ -39,62 +614,288 @@ static int stringCmp(const void *a, const void *b);
  * @return 0 if successful, something other if not
  */
 int main(int argc, char *argv[]) {
+  Mode mode = MODE_DUPLICATES;
+  int approximate = 0;
+  size_t bloomBudget = BLOOM_DEFAULT_BUDGET;
+  double bloomRate = BLOOM_DEFAULT_RATE;
+  // -1 no statistics, 0 as text, 1 as JSON
+  int statsFormat = -1;
+  // Seconds between two runs of --watch, 0 to run once
+  double watchInterval = 0;
+
+  static const struct option longOptions[] = {
+    { "stats", optional_argument, NULL, OPTION_STATS },
+    { "watch", required_argument, NULL, OPTION_WATCH },
+    { NULL, 0, NULL, 0 }
+  };
+
   if (argc > 0) {
     programName = argv[0];
   }
-  if (argc != 3) {
+
+  findNewlines = selectNewlineFinder();
+  arenaInit();
+  outputInit();
+
+  int getopt_result;
+  while ((getopt_result = getopt_long(argc, argv, "isucam:e:k:nf", longOptions, NULL)) != -1) {
+    switch (getopt_result) {
+      case 'i':
+      case 's':
+      case 'u':
+      case 'c':
+        if (mode != MODE_DUPLICATES) {
+          // Only one mode at a time
+          usage();
+        }
+        break;
+      default:
+        break;
+    }
+    switch (getopt_result) {
+      case 'i':
+        mode = MODE_INTERSECT;
+        break;
+      case 's':
+        mode = MODE_SUBTRACT;
+        break;
+      case 'u':
+        mode = MODE_UNION;
+        break;
+      case 'c':
+        mode = MODE_COUNT;
+        break;
+      case 'a':
+        approximate = 1;
+        break;
+      case 'm':
+        bloomBudget = parseSize(optarg);
+        if (bloomBudget < BLOOM_BLOCK_SIZE) {
+          usage();
+        }
+        break;
+      case 'e': {
+        char *end;
+        bloomRate = strtod(optarg, &end);
+        if (end == optarg || *end != '\0' || !(bloomRate > 0 && bloomRate < 1)) {
+          usage();
+        }
+        break;
+      }
+      case 'k':
+        if (sortKey.startField != 1 || sortKey.endField != 0 || !parseKey(optarg)) {
+          // One key, as F[.C][,F[.C]]
+          usage();
+        }
+        sortKey.enabled = 1;
+        break;
+      case 'n':
+        sortKey.numeric = 1;
+        sortKey.enabled = 1;
+        break;
+      case 'f':
+        sortKey.fold = 1;
+        sortKey.enabled = 1;
+        break;
+      case OPTION_STATS:
+        if (optarg == NULL || strcmp(optarg, "text") == 0) {
+          statsFormat = 0;
+        } else if (strcmp(optarg, "json") == 0) {
+          statsFormat = 1;
+        } else {
+          usage();
+        }
+        break;
+      case OPTION_WATCH: {
+        char *end;
+        watchInterval = strtod(optarg, &end);
+        if (end == optarg || *end != '\0' || !(watchInterval > 0) || !isfinite(watchInterval)) {
+          usage();
+        }
+        break;
+      }
+      case '?':
+        usage();
+        break;
+      default:
+        assert(0);
+    }
+  }
+
+  if (argc - optind != 2) {
+    usage();
+  }
+  if (approximate && mode != MODE_DUPLICATES && mode != MODE_COUNT) {
+    // The spool does not remember which command printed a line
+    usage();
+  }
+  if (watchInterval > 0 && (approximate || mode == MODE_COUNT)) {
+    // Only set membership can be updated line by line
+    usage();
+  }
+  if (sortKey.enabled && ((mode != MODE_DUPLICATES && mode != MODE_COUNT) || watchInterval > 0)) {
+    // Only sorted output has an order to change
     usage();
   }
 
-  char *commandOne = argv[1];
-  char *commandTwo = argv[2];
+  char *commandOne = argv[optind];
+  char *commandTwo = argv[optind + 1];
+
+  if (watchInterval > 0) {
+    watch(commandOne, commandTwo, mode, watchInterval, statsFormat);
+  }
+
+  // All kept lines and their current count
+  Collector collector;
+  memset(&collector, 0, sizeof(collector));
+
+  if (mode != MODE_DUPLICATES || approximate) {
+    LineTable table;
+    tableInit(&table);
+    collector.table = &table;
+
+    BloomFilter filter;
+    if (approximate) {
+      // First pass: keep only lines the filter has (probably) seen before,
+      // spool everything else to disk for the exact second pass.
+      bloomInit(&filter, bloomBudget, bloomRate);
+      collector.filter = &filter;
+      collector.spool = tmpfile();
+      if (collector.spool == NULL) {
+        (void) fprintf(stderr, "tmpfile() call failed.\n");
+        exit(EXIT_FAILURE);
+      }
+    }
 
-  // All lines and its current count
-  char **lines = NULL;
-  unsigned int linesCount = 0;
+    // Hash join: tag every distinct line with the commands it came from
+    // and print the matching ones in order of their first appearance,
+    // or count every distinct line and print the duplicated ones sorted.
+    getLines(commandOne, 0, &collector);
+    getLines(commandTwo, 1, &collector);
 
-  // Run first command
-  getLines(commandOne, &lines, &linesCount);
+    if (approximate) {
+      bloomFree(&filter);
+      phaseStart(PHASE_DEDUP);
+      confirmCandidates(&collector);
+      phaseStop(PHASE_DEDUP);
+      fclose(collector.spool);
+      printDuplicates(&table, collector.lines, mode == MODE_COUNT);
+    } else if (mode == MODE_COUNT) {
+      printDuplicates(&table, collector.lines, 1);
+    } else {
+      phaseStart(PHASE_OUTPUT);
+      for (unsigned int i = 0; i < collector.linesCount; i++) {
+        if (modeMatches(mode, table.sources[i])) {
+          printLine(&collector.lines[i]);
+        }
+      }
+      outputFlush();
+      phaseStop(PHASE_OUTPUT);
+    }
 
-  // Run second command
-  getLines(commandTwo, &lines, &linesCount);
+    tableFree(&table);
+    collectorFree(&collector);
 
-  /*for (int i = 0; i < linesCount; i++) {
-    printf("%s", lines[i]);
-  }*/
+    if (statsFormat != -1) {
+      printStats(statsFormat);
+    }
 
-  // Sort out lines
-  qsort(lines, linesCount, sizeof(char*), stringCmp);
+    return EXIT_SUCCESS;
+  }
 
-  /*printf("* Sorted *\n");
-  for (int i = 0; i < linesCount; i++) {
-    printf("%s", lines[i]);
-  }*/
+  // Run both commands, most of the lines are sorted and front-coded into
+  // runs by the time they finish.
+  getLinesPipelined(commandOne, commandTwo, &collector);
 
-  // printf("*** AAA ***\n");
+  Line *lines = collector.lines;
+  unsigned int linesCount = collector.linesCount;
 
-  char **uniqLines = NULL;
+  Line *uniqLines = NULL;
   unsigned int uniqLinesCount = 0;
-  uniq(lines, linesCount, &uniqLines, &uniqLinesCount);
+  FrontCoded duplicates = { NULL, 0, 0, 0, 0 };
+
+  if (sortKey.enabled) {
+    // Equal lines still end up next to each other, the last resort of
+    // keyCmp compares whole lines.
+    phaseStart(PHASE_SORT);
+    uint32_t *order = xmalloc(sizeof(uint32_t) * (linesCount + 1));
+    sortKeyed(lines, linesCount, order);
+    Line *sorted = xmalloc(sizeof(Line) * (linesCount + 1));
+    for (unsigned int i = 0; i < linesCount; i++) {
+      sorted[i] = lines[order[i]];
+    }
+    free(order);
+    free(collector.lines);
+    collector.lines = lines = sorted;
+    phaseStop(PHASE_SORT);
 
-  for (int i = 0; i < uniqLinesCount; i++) {
-    printf("%s", uniqLines[i]);
+    uniq(lines, linesCount, &uniqLines, &uniqLinesCount);
+  } else {
+    // The runs are sorted and front-coded already, merge them and find
+    // the duplicates on the way.
+    phaseStart(PHASE_DEDUP);
+    mergeUniq(collector.runs, collector.runsCount, &duplicates);
+    phaseStop(PHASE_DEDUP);
+  }
+
+  phaseStart(PHASE_OUTPUT);
+  if (sortKey.enabled) {
+    for (unsigned int i = 0; i < uniqLinesCount; i++) {
+      printLine(&uniqLines[i]);
+    }
+  } else {
+    printFrontCoded(&duplicates);
   }
+  outputFlush();
+  phaseStop(PHASE_OUTPUT);
 
   // Free global stuff
-  recursiveFree(lines, linesCount);
+  free(uniqLines);
+  free(duplicates.data);
+  collectorFree(&collector);
+
+  if (statsFormat != -1) {
+    printStats(statsFormat);
+  }
 
   return EXIT_SUCCESS;
 }
 
 /**
- * Runs the given command and returns the lines
+ * Runs the given command and passes its lines to the collector
+ *
+ * @param command The command you want to run
+ * @param source The index of the command (0 or 1)
+ * @param collector The collector which keeps the lines, with a table
+ */
+static void getLines(char *command, unsigned int source, Collector *collector) {
+  phaseStart(PHASE_SPAWN);
+  pid_t childPid;
+  int fd = spawnCommand(command, &childPid);
+  phaseStop(PHASE_SPAWN);
+
+  collector->sourceStart[source] = collector->linesCount;
+
+  // Read everything before waiting, the child blocks as soon as the
+  // pipe buffer is full.
+  phaseStart(PHASE_READ);
+  stats.bytes[source] += readLines(fd, source, collectLine, collector);
+  phaseStop(PHASE_READ);
+
+  phaseStart(PHASE_SPAWN);
+  waitCommand(childPid, fd);
+  phaseStop(PHASE_SPAWN);
+}
+
+/**
+ * Starts the given command with its stdout connected to a pipe
  *
  * @param command The command you want to run
- * @param lines A pointer to the lines which will be fetched
- * @param linesCount A pointer to the number of lines fetched
+ * @param childPid Receives the pid of the child running the command
+ *
+ * @return The read end of the pipe
  */
-static void getLines(char *command, char ***lines, unsigned int* linesCount) {
+static int spawnCommand(char *command, pid_t *childPid) {
   // pipe
   int pipes[2];
   if (pipe(pipes) != 0) {
@@ -102,15 +903,18 @@ static void getLines(char *command, char ***lines, unsigned int* linesCount) {
     exit(EXIT_FAILURE);
   }
 
-  pid_t childPid = fork();
-  if (childPid == -1) {
+  // The child must not flush our pending output (e.g. the spool) again
+  fflush(NULL);
+
+  *childPid = fork();
+  if (*childPid == -1) {
     (void) fprintf(stderr, "fork() call failed.\n");
     close(pipes[0]);
     close(pipes[1]);
     exit(EXIT_FAILURE);
   }
 
-  if (childPid == 0) {
+  if (*childPid == 0) {
     // Child process. Run command and exit
     // Close read end
     close(pipes[0]);
@@ -135,228 +939,2100 @@ static void getLines(char *command, char ***lines, unsigned int* linesCount) {
     close(pipes[1]);
 
     exit(EXIT_SUCCESS);
-  } else {
-    // Parent process. Wait for child to exit and read from its stdout
-    // Close write end
-    close(pipes[1]);
-
-    // dup2 stdin with read end
-    if (dup2(pipes[0], STDIN_FILENO) == -1) {
-      (void) fprintf(stderr, "dup2() call failed.\n");
-      close(pipes[0]);
-      exit(EXIT_FAILURE);
-    }
-
-    int *status = malloc(sizeof(int));
-    if (waitpid(childPid, status, 0) == -1) {
-      (void) fprintf(stderr, "waitpid() call failed.\n");
-      free(status);
-      close(pipes[0]);
-      exit(EXIT_FAILURE);
-    }
-
-    if (*status != 0) {
-      (void) fprintf(stderr, "child process returned non zero exit code.\n");
-      free(status);
-      close(pipes[0]);
-      exit(EXIT_FAILURE);
-    }
-
-    // Read
-    char *line = malloc(sizeof(char) * 1024);
-    while (fgets(line, 1024, stdin) != NULL) {
-      if (*linesCount == 0) {
-        *lines = malloc(sizeof(char*));
-      } else {
-        *lines = realloc(*lines, sizeof(char*) * (*linesCount + 1));
-      }
-      (*lines)[*linesCount] = line;
-      (*linesCount)++;
-      line = malloc(sizeof(char) * 1024);
-    }
-    // Last allocated line won't be used
-    free(line);
-    // Reset stdin
-    clearerr(stdin);
-
-    /*
-    for (int i = 0; i < linesCount; i++) {
-      printf("%s", lines[i]);
-    }*/
-
-    free(status);
-
-    close(pipes[0]);
   }
+
+  // Parent process. Close write end, EOF arrives once the child is done
+  close(pipes[1]);
+  return pipes[0];
 }
 
 /**
- * Runs uniq -d on top of the given lines and writes the response
- * to uniqLines.
+ * Waits for a command started by spawnCommand() and terminates if it failed
  *
- * @param lines A pointer to the lines you want to uniq
- * @param linesCount The number of lines in lines
- * @param uniqLines A pointer to the lines which were generated by uniq
- * @param uniqLinesCount A Pointer to the number of lines fetched by uniq
+ * @param childPid The pid of the child running the command
+ * @param fd The read end of the command's pipe, closed here
  */
-static void uniq(char **lines, unsigned int linesCount, char ***uniqLines, unsigned int *uniqLinesCount) {
-  // pipe
-  int pipes[2];
-  if (pipe(pipes) != 0) {
-    (void) fprintf(stderr, "pipe() call failed.\n");
-    recursiveFree(lines, linesCount);
+static void waitCommand(pid_t childPid, int fd) {
+  int *status = xmalloc(sizeof(int));
+  if (waitpid(childPid, status, 0) == -1) {
+    (void) fprintf(stderr, "waitpid() call failed.\n");
+    free(status);
+    close(fd);
     exit(EXIT_FAILURE);
   }
 
-  int linesPipes[2];
-  if (pipe(linesPipes) != 0) {
-    (void) fprintf(stderr, "pipe() call failed.\n");
-    close(pipes[0]);
-    close(pipes[1]);
-    recursiveFree(lines, linesCount);
+  if (*status != 0) {
+    (void) fprintf(stderr, "child process returned non zero exit code.\n");
+    free(status);
+    close(fd);
     exit(EXIT_FAILURE);
   }
 
-  pid_t childPid = fork();
-  if (childPid == -1) {
-    (void) fprintf(stderr, "fork() call failed.\n");
-    close(pipes[0]);
-    close(pipes[1]);
-    close(linesPipes[0]);
-    close(linesPipes[1]);
-    recursiveFree(lines, linesCount);
+  free(status);
+
+  close(fd);
+}
+
+/**
+ * Runs both commands at the same time and collects all of their lines as
+ * sorted runs.
+ *
+ * A reader thread per command reads its output into the arena, parser
+ * threads turn every block into a sorted, front-coded run as it arrives.
+ * Keyed orders sort all lines at once, their blocks are only indexed and
+ * the lines are concatenated, command by command.
+ *
+ * @param commandOne The first command
+ * @param commandTwo The second command
+ * @param collector The collector which receives the runs or the lines,
+ * without a table
+ */
+static void getLinesPipelined(char *commandOne, char *commandTwo, Collector *collector) {
+  // Fork before starting any thread
+  phaseStart(PHASE_SPAWN);
+  pid_t childPids[2];
+  Reader readers[2];
+  readers[0].fd = spawnCommand(commandOne, &childPids[0]);
+  readers[1].fd = spawnCommand(commandTwo, &childPids[1]);
+  phaseStop(PHASE_SPAWN);
+
+  // Reading and sorting overlap, both count as reading
+  phaseStart(PHASE_READ);
+  Pipeline pipeline;
+  memset(&pipeline, 0, sizeof(pipeline));
+  if (pthread_mutex_init(&pipeline.mutex, NULL) != 0 || pthread_cond_init(&pipeline.changed, NULL) != 0
+      || pthread_cond_init(&pipeline.taken, NULL) != 0) {
+    (void) fprintf(stderr, "pthread_mutex_init() call failed.\n");
     exit(EXIT_FAILURE);
   }
+  pipeline.readersLeft = 2;
 
-  if (childPid == 0) {
-    // Child process. Run command and exit
-    // Close read end
-    close(pipes[0]);
+  long processors = sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned int parsersCount = processors < 1 ? 1 : processors > PIPELINE_MAX_PARSERS ? PIPELINE_MAX_PARSERS : processors;
+  pipeline.queueLimit = 2 * parsersCount;
+  pthread_t readerThreads[2];
+  pthread_t parserThreads[PIPELINE_MAX_PARSERS];
 
-    // Lines!?
-    close(linesPipes[1]);
-    if (dup2(linesPipes[0], STDIN_FILENO) == -1) {
-      (void) fprintf(stderr, "dup2() call failed.\n");
-      close(pipes[1]);
-      close(linesPipes[0]);
+  for (unsigned int i = 0; i < 2; i++) {
+    readers[i].pipeline = &pipeline;
+    readers[i].source = i;
+    if (pthread_create(&readerThreads[i], NULL, readerMain, &readers[i]) != 0) {
+      (void) fprintf(stderr, "pthread_create() call failed.\n");
       exit(EXIT_FAILURE);
     }
-
-    // dup2 stdout with write end
-    if (dup2(pipes[1], STDOUT_FILENO) == -1) {
-      (void) fprintf(stderr, "dup2() call failed.\n");
-      close(pipes[1]);
-      close(linesPipes[0]);
+  }
+  for (unsigned int i = 0; i < parsersCount; i++) {
+    if (pthread_create(&parserThreads[i], NULL, parserMain, &pipeline) != 0) {
+      (void) fprintf(stderr, "pthread_create() call failed.\n");
       exit(EXIT_FAILURE);
     }
+  }
 
-    char *buf = malloc(sizeof(char*) * 2048);
-    sprintf(buf, "%s%s%s", "/bin/bash -c \"", "uniq -d", "\"");
-    if (system(buf) == -1) {
-      (void) fprintf(stderr, "command() call failed.\n");
-      free(buf);
-      close(pipes[1]);
-      close(linesPipes[0]);
+  for (unsigned int i = 0; i < 2; i++) {
+    (void) pthread_join(readerThreads[i], NULL);
+  }
+  for (unsigned int i = 0; i < parsersCount; i++) {
+    (void) pthread_join(parserThreads[i], NULL);
+  }
+  (void) pthread_mutex_destroy(&pipeline.mutex);
+  (void) pthread_cond_destroy(&pipeline.changed);
+  (void) pthread_cond_destroy(&pipeline.taken);
+  phaseStop(PHASE_READ);
+
+  phaseStart(PHASE_SPAWN);
+  waitCommand(childPids[0], readers[0].fd);
+  waitCommand(childPids[1], readers[1].fd);
+  phaseStop(PHASE_SPAWN);
+
+  pipelineCollect(&pipeline, collector);
+}
+
+/**
+ * Reader thread: reads a command's output into blocks of the arena and
+ * queues the complete lines of every full block. A line crossing the end
+ * of a block is moved to the start of the next one.
+ *
+ * @param argument The Reader
+ *
+ * @return NULL
+ */
+static void *readerMain(void *argument) {
+  Reader *reader = argument;
+  Pipeline *pipeline = reader->pipeline;
+  size_t sequence = 0;
+  size_t total = 0;
+  size_t capacity = PIPELINE_BLOCK_SIZE;
+  size_t block = pipelineClaim(pipeline, capacity);
+  // Bytes in the block
+  size_t used = 0;
+
+  for (;;) {
+    size_t wanted = capacity - used;
+    if (wanted > CHUNK_SIZE) {
+      wanted = CHUNK_SIZE;
+    }
+    ssize_t bytes = read(reader->fd, arena.base + block + used, wanted);
+    if (bytes == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      (void) fprintf(stderr, "read() call failed.\n");
       exit(EXIT_FAILURE);
     }
-    free(buf);
+    if (bytes == 0) {
+      break;
+    }
+    used += bytes;
+    total += bytes;
+    if (used < capacity) {
+      continue;
+    }
 
-    close(pipes[1]);
-    close(linesPipes[0]);
+    // Full, hand over everything up to the last newline. Make sure a
+    // single huge line always finds room in the next block.
+    size_t end = used;
+    while (end > 0 && arena.base[block + end - 1] != '\n') {
+      end--;
+    }
+    size_t partial = used - end;
+    if (end > 0) {
+      pipelinePush(pipeline, reader->source, sequence++, block, end);
+    }
+    capacity = partial * 2 > PIPELINE_BLOCK_SIZE ? partial * 2 : PIPELINE_BLOCK_SIZE;
+    size_t next = pipelineClaim(pipeline, capacity);
+    memcpy(arena.base + next, arena.base + block + end, partial);
+    block = next;
+    used = partial;
+  }
 
-    exit(EXIT_SUCCESS);
+  if (used > 0) {
+    pipelinePush(pipeline, reader->source, sequence, block, used);
+  }
+  stats.bytes[reader->source] += total;
+
+  pthread_mutex_lock(&pipeline->mutex);
+  pipeline->readersLeft--;
+  pthread_cond_broadcast(&pipeline->changed);
+  pthread_mutex_unlock(&pipeline->mutex);
+  return NULL;
+}
+
+/**
+ * Reserves bytes at the end of the arena for a reader thread
+ *
+ * @param pipeline The pipeline, guards the arena
+ * @param length Number of bytes to reserve
+ *
+ * @return The offset of the reserved bytes
+ */
+static size_t pipelineClaim(Pipeline *pipeline, size_t length) {
+  pthread_mutex_lock(&pipeline->mutex);
+  if (length > arena.size - arena.used) {
+    (void) fprintf(stderr, "%s: The commands printed more than %zu bytes.\n", programName, arena.size);
+    exit(EXIT_FAILURE);
+  }
+  size_t offset = arena.used;
+  arena.used += length;
+  pthread_mutex_unlock(&pipeline->mutex);
+  return offset;
+}
+
+/**
+ * Queues a block of complete lines for the parser threads, waits while the
+ * queue is full
+ *
+ * @param pipeline The pipeline
+ * @param source The index of the command which printed the lines
+ * @param sequence Position of the block in the output of the command
+ * @param offset Offset of the first byte in the arena
+ * @param length Number of bytes
+ */
+static void pipelinePush(Pipeline *pipeline, unsigned int source, size_t sequence, size_t offset, size_t length) {
+  Block *block = xmalloc(sizeof(Block));
+  block->source = source;
+  block->sequence = sequence;
+  block->offset = offset;
+  block->length = length;
+  block->next = NULL;
+
+  pthread_mutex_lock(&pipeline->mutex);
+  // A fast command waits for the parsers, in its pipe
+  while (pipeline->queued >= pipeline->queueLimit) {
+    pthread_cond_wait(&pipeline->taken, &pipeline->mutex);
+  }
+  pipeline->queued++;
+  if (pipeline->tail == NULL) {
+    pipeline->head = block;
   } else {
-    // Parent process. Wait for child to exit and read from its stdout
-    // Close write end
-    close(pipes[1]);
+    pipeline->tail->next = block;
+  }
+  pipeline->tail = block;
+  pthread_cond_signal(&pipeline->changed);
+  pthread_mutex_unlock(&pipeline->mutex);
+}
+
+/**
+ * Parser thread: turns queued blocks into sorted, front-coded runs until
+ * the readers are done and the queue is empty.
+ *
+ * @param argument The Pipeline
+ *
+ * @return NULL
+ */
+static void *parserMain(void *argument) {
+  Pipeline *pipeline = argument;
+  uint32_t *positions = xmalloc(sizeof(uint32_t) * CHUNK_SIZE);
 
-    close(linesPipes[0]);
-    // Write given lines to child process
-    for (int i = 0; i < linesCount; i++) {
-      write(linesPipes[1], lines[i], strlen(lines[i]));
+  for (;;) {
+    pthread_mutex_lock(&pipeline->mutex);
+    while (pipeline->head == NULL && pipeline->readersLeft > 0) {
+      pthread_cond_wait(&pipeline->changed, &pipeline->mutex);
+    }
+    Block *block = pipeline->head;
+    if (block == NULL) {
+      pthread_mutex_unlock(&pipeline->mutex);
+      break;
     }
-    close(linesPipes[1]);
+    pipeline->head = block->next;
+    if (pipeline->head == NULL) {
+      pipeline->tail = NULL;
+    }
+    pipeline->queued--;
+    pthread_cond_signal(&pipeline->taken);
+    pthread_mutex_unlock(&pipeline->mutex);
 
-    // dup2 stdin with read end
-    if (dup2(pipes[0], STDIN_FILENO) == -1) {
-      (void) fprintf(stderr, "dup2() call failed.\n");
-      close(pipes[0]);
-      recursiveFree(lines, linesCount);
-      exit(EXIT_FAILURE);
+    Run run = parseBlock(block, positions);
+    if (!sortKey.enabled) {
+      // Neighbours share long prefixes now, the block's bytes are not
+      // needed any more
+      frontCode(run.lines, run.count, &run.coded);
+      free(run.lines);
+      run.lines = NULL;
+      arenaRelease(block->offset, block->length);
     }
 
-    int *status = malloc(sizeof(int));
-    if (waitpid(childPid, status, 0) == -1) {
-      (void) fprintf(stderr, "waitpid() call failed.\n");
-      free(status);
-      close(pipes[0]);
-      recursiveFree(lines, linesCount);
-      exit(EXIT_FAILURE);
+    pthread_mutex_lock(&pipeline->mutex);
+    unsigned int source = block->source;
+    if (block->sequence >= pipeline->runsCapacity[source]) {
+      size_t capacity = pipeline->runsCapacity[source] == 0 ? 16 : pipeline->runsCapacity[source];
+      while (capacity <= block->sequence) {
+        capacity *= 2;
+      }
+      pipeline->runs[source] = xrealloc(pipeline->runs[source], sizeof(Run) * capacity);
+      pipeline->runsCapacity[source] = capacity;
+    }
+    // Blocks finish out of order, the gaps are filled by the others
+    pipeline->runs[source][block->sequence] = run;
+    if (block->sequence >= pipeline->runsCount[source]) {
+      pipeline->runsCount[source] = block->sequence + 1;
+    }
+    stats.lines[source] += run.count;
+    pthread_mutex_unlock(&pipeline->mutex);
+
+    free(block);
+  }
+
+  free(positions);
+  return NULL;
+}
+
+/**
+ * Finds the lines of a block and sorts them
+ *
+ * @param block The block
+ * @param positions Scratch space for CHUNK_SIZE newline positions
+ *
+ * @return The sorted lines
+ */
+static Run parseBlock(const Block *block, uint32_t *positions) {
+  const char *data = arena.base + block->offset;
+  Run run = { NULL, 0 };
+  size_t capacity = 0;
+  // Start of the line not terminated yet
+  size_t start = 0;
+
+  for (size_t piece = 0; piece < block->length; piece += CHUNK_SIZE) {
+    size_t pieceLength = block->length - piece < CHUNK_SIZE ? block->length - piece : CHUNK_SIZE;
+    size_t found = findNewlines(data + piece, pieceLength, positions);
+    if (run.count + found + 1 > capacity) {
+      capacity = (run.count + found + 1) * 2;
+      run.lines = xrealloc(run.lines, sizeof(Line) * capacity);
+    }
+    for (size_t i = 0; i < found; i++) {
+      size_t end = piece + positions[i];
+      run.lines[run.count].offset = block->offset + start;
+      run.lines[run.count].length = end - start;
+      run.count++;
+      start = end + 1;
+    }
+  }
+
+  // Only the last block of a command may end without a newline
+  if (start < block->length) {
+    if (run.count == capacity) {
+      run.lines = xrealloc(run.lines, sizeof(Line) * (capacity + 1));
+    }
+    run.lines[run.count].offset = block->offset + start;
+    run.lines[run.count].length = block->length - start;
+    run.count++;
+  }
+
+  // Already sorted output only costs the check. Keyed orders are sorted
+  // at once afterwards.
+  for (unsigned int i = 1; i < run.count && !sortKey.enabled; i++) {
+    if (stringCmp(&run.lines[i - 1], &run.lines[i]) > 0) {
+      qsort(run.lines, run.count, sizeof(Line), stringCmp);
+      break;
+    }
+  }
+  return run;
+}
+
+/**
+ * Hands the front-coded runs of the pipeline to the collector. For keyed
+ * orders the lines of the runs are concatenated instead, the first
+ * command's before the second's.
+ *
+ * @param pipeline The pipeline after all threads finished
+ * @param collector The collector to fill
+ */
+static void pipelineCollect(Pipeline *pipeline, Collector *collector) {
+  size_t total = 0;
+  size_t runsTotal = 0;
+  for (unsigned int source = 0; source < 2; source++) {
+    for (size_t i = 0; i < pipeline->runsCount[source]; i++) {
+      total += pipeline->runs[source][i].count;
+    }
+    runsTotal += pipeline->runsCount[source];
+  }
+  if (sortKey.enabled) {
+    collector->lines = xmalloc(sizeof(Line) * (total + 1));
+    collector->linesCapacity = total + 1;
+  } else {
+    collector->runs = xmalloc(sizeof(FrontCoded) * (runsTotal + 1));
+  }
+
+  for (unsigned int source = 0; source < 2; source++) {
+    collector->sourceStart[source] = collector->linesCount;
+    for (size_t i = 0; i < pipeline->runsCount[source]; i++) {
+      Run *run = &pipeline->runs[source][i];
+      if (run->count == 0) {
+        continue;
+      }
+      if (run->lines == NULL) {
+        collector->runs[collector->runsCount++] = run->coded;
+        continue;
+      }
+      memcpy(collector->lines + collector->linesCount, run->lines, sizeof(Line) * run->count);
+      collector->linesCount += run->count;
+      free(run->lines);
+    }
+    free(pipeline->runs[source]);
+  }
+}
+
+/**
+ * Reads fd until EOF in blocks of up to CHUNK_SIZE bytes and passes every
+ * line to the sink.
+ *
+ * The newlines of each block are indexed at once by findNewlines(). One
+ * buffer is reused, a line crossing its end is moved to its start.
+ *
+ * @param fd The file descriptor to read
+ * @param source The index of the command fd belongs to
+ * @param sink Receives every line
+ * @param context Passed to sink
+ *
+ * @return The number of bytes read
+ */
+static size_t readLines(int fd, unsigned int source, LineSink sink, void *context) {
+  size_t capacity = CHUNK_SIZE;
+  char *chunk = xmalloc(capacity);
+  uint32_t *positions = xmalloc(sizeof(uint32_t) * CHUNK_SIZE);
+  // Bytes in chunk
+  size_t used = 0;
+  // Start of the line not terminated yet
+  size_t start = 0;
+  // Bytes read over all buffers
+  size_t total = 0;
+
+  for (;;) {
+    if (used == capacity) {
+      // Start over with the unfinished line. Make sure a single huge line
+      // always finds room.
+      size_t partial = used - start;
+      size_t nextCapacity = partial * 2 > CHUNK_SIZE ? partial * 2 : CHUNK_SIZE;
+      memmove(chunk, chunk + start, partial);
+      if (nextCapacity != capacity) {
+        chunk = xrealloc(chunk, nextCapacity);
+      }
+      capacity = nextCapacity;
+      used = partial;
+      start = 0;
     }
 
-    if (*status != 0) {
-      (void) fprintf(stderr, "child process returned non zero exit code.\n");
-      free(status);
-      close(pipes[0]);
-      recursiveFree(lines, linesCount);
+    size_t wanted = capacity - used;
+    if (wanted > CHUNK_SIZE) {
+      wanted = CHUNK_SIZE;
+    }
+    ssize_t bytes = read(fd, chunk + used, wanted);
+    if (bytes == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      (void) fprintf(stderr, "read() call failed.\n");
       exit(EXIT_FAILURE);
     }
+    if (bytes == 0) {
+      break;
+    }
+
+    size_t found = findNewlines(chunk + used, bytes, positions);
+    for (size_t i = 0; i < found; i++) {
+      size_t end = used + positions[i];
+      sink(context, chunk + start, end - start, source);
+      start = end + 1;
+    }
+    used += bytes;
+    total += bytes;
+  }
+
+  // The last line may lack its newline
+  if (start < used) {
+    sink(context, chunk + start, used - start, source);
+  }
+
+  free(chunk);
+  free(positions);
+  return total;
+}
+
+/**
+ * LineSink of getLines(), passes a line to the collector
+ *
+ * Only distinct lines (or candidates in approximate mode) are kept,
+ * copied to the arena so the read buffer can be reused.
+ *
+ * @param context The collector
+ * @param data The line
+ * @param length Number of bytes in the line
+ * @param source The index of the command which printed the line
+ */
+static void collectLine(void *context, const char *data, size_t length, unsigned int source) {
+  Collector *collector = context;
+  stats.lines[source]++;
+
+  if (collector->table != NULL) {
+    uint64_t hash = hashLine(data, length);
+
+    if (collector->filter != NULL) {
+      if (fwrite(data, 1, length, collector->spool) != length || putc('\n', collector->spool) == EOF) {
+        (void) fprintf(stderr, "fwrite() call failed.\n");
+        exit(EXIT_FAILURE);
+      }
+      if (!bloomAdd(collector->filter, hash)) {
+        // Definitely the first occurrence, the second pass will see it.
+        return;
+      }
+    }
 
-    // Read
-    char *line = malloc(sizeof(char) * 1024);
-    while (fgets(line, 1024, stdin) != NULL) {
-      if (*uniqLinesCount == 0) {
-        *uniqLines = malloc(sizeof(char*));
-      } else {
-        *uniqLines = realloc(*uniqLines, sizeof(char*) * (*uniqLinesCount + 1));
+    Watch *state = collector->watch;
+    if (state != NULL) {
+      LineSlot *slot = tableFind(collector->table, collector->lines, data, length, hash);
+      if (slot != NULL) {
+        state->ticks[slot->line - 1][source]++;
+        return;
+      }
+      if (collector->linesCount == state->capacity) {
+        state->capacity = state->capacity == 0 ? 1024 : state->capacity * 2;
+        state->counts = xrealloc(state->counts, sizeof(state->counts[0]) * state->capacity);
+        state->ticks = xrealloc(state->ticks, sizeof(state->ticks[0]) * state->capacity);
       }
-      (*uniqLines)[*uniqLinesCount] = line;
-      (*uniqLinesCount)++;
-      line = malloc(sizeof(char) * 1024);
+      state->counts[collector->linesCount][0] = 0;
+      state->counts[collector->linesCount][1] = 0;
+      state->ticks[collector->linesCount][0] = 0;
+      state->ticks[collector->linesCount][1] = 0;
+      state->ticks[collector->linesCount][source] = 1;
     }
-    // Last allocated line won't be used
-    free(line);
-    // Reset stdin
-    clearerr(stdin);
 
-    free(status);
+    if (!tableAdd(collector->table, collector->lines, collector->linesCount, data, length, hash, source)) {
+      // Seen before, only its source mask and count changed.
+      return;
+    }
+  }
 
-    close(pipes[0]);
+  if (collector->linesCount == collector->linesCapacity) {
+    collector->linesCapacity = collector->linesCapacity == 0 ? 1024 : collector->linesCapacity * 2;
+    collector->lines = xrealloc(collector->lines, sizeof(Line) * collector->linesCapacity);
   }
+  // Distinct lines stay around for the whole run, the read buffer not
+  Line *line = &collector->lines[collector->linesCount];
+  line->offset = arenaAppend(data, length);
+  line->length = length;
+
+  collector->linesCount++;
 }
 
 /**
- * Prints the usage of this program and terminates with EXIT_FAILURE
+ * LineSink of the second pass of the approximate mode. Counts a line of
+ * the spool if it is one of the candidates.
+ *
+ * @param context The collector after the first pass
+ * @param data The line
+ * @param length Number of bytes in the line
+ * @param source Unused
  */
-static void usage(void) {
-  (void) fprintf(stderr, "Usage: %s \"command1\" \"command2\"\n",
-                 programName);
-  exit(EXIT_FAILURE);
+static void confirmLine(void *context, const char *data, size_t length, unsigned int source) {
+  Collector *collector = context;
+  LineSlot *slot = tableFind(collector->table, collector->lines, data, length, hashLine(data, length));
+  if (slot != NULL) {
+    slot->count++;
+  }
 }
 
 /**
- * Frees the given array of strings recursively
+ * Finds all newlines in a block of data, one byte at a time
+ *
+ * @param data The data to scan
+ * @param length Number of bytes in data
+ * @param positions Receives the offset of every newline, in order
  *
- * @param lines The lines you want to recursive free
- * @param linesCount The number of elements in lines
+ * @return The number of newlines found
  */
-static void recursiveFree(char** lines, unsigned int linesCount) {
-  for(int i = 0; i < linesCount; i++) {
-    free(lines[i]);
+static size_t findNewlinesScalar(const char *data, size_t length, uint32_t *positions) {
+  size_t count = 0;
+  for (size_t i = 0; i < length; i++) {
+    if (data[i] == '\n') {
+      positions[count++] = i;
+    }
   }
-  free(lines);
+  return count;
 }
 
+#ifdef HAVE_X86_SIMD
 /**
- * Compares two strings
+ * Finds all newlines in a block of data, 16 bytes at a time with SSE2
  *
- * @param a The first string
- * @param b The second string
+ * Each block is compared against '\n', the result is turned into a bit
+ * mask with movemask and the set bits are extracted lowest first.
  *
- * @return negative if a is smaller, positive if a is larger and 0 if a and b are equal
+ * @param data The data to scan
+ * @param length Number of bytes in data
+ * @param positions Receives the offset of every newline, in order
+ *
+ * @return The number of newlines found
  */
-static int stringCmp(const void *a, const void *b) {
-  const char **ia = (const char **)a;
-  const char **ib = (const char **)b;
-  return strcmp(*ia, *ib);
+__attribute__((target("sse2")))
+static size_t findNewlinesSse2(const char *data, size_t length, uint32_t *positions) {
+  const __m128i newline = _mm_set1_epi8('\n');
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *) (data + i));
+    uint32_t mask = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+    while (mask != 0) {
+      positions[count++] = i + __builtin_ctz(mask);
+      mask &= mask - 1;
+    }
+  }
+  for (; i < length; i++) {
+    if (data[i] == '\n') {
+      positions[count++] = i;
+    }
+  }
+  return count;
+}
+
+/**
+ * Finds all newlines in a block of data, 64 bytes at a time with AVX2
+ *
+ * Same as findNewlinesSse2() but two 32 byte masks are combined into one
+ * 64 bit mask per iteration.
+ *
+ * @param data The data to scan
+ * @param length Number of bytes in data
+ * @param positions Receives the offset of every newline, in order
+ *
+ * @return The number of newlines found
+ */
+__attribute__((target("avx2")))
+static size_t findNewlinesAvx2(const char *data, size_t length, uint32_t *positions) {
+  const __m256i newline = _mm256_set1_epi8('\n');
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 64 <= length; i += 64) {
+    __m256i low = _mm256_loadu_si256((const __m256i *) (data + i));
+    __m256i high = _mm256_loadu_si256((const __m256i *) (data + i + 32));
+    uint64_t mask = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(low, newline))
+                    | (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(high, newline)) << 32;
+    while (mask != 0) {
+      positions[count++] = i + __builtin_ctzll(mask);
+      mask &= mask - 1;
+    }
+  }
+  for (; i < length; i++) {
+    if (data[i] == '\n') {
+      positions[count++] = i;
+    }
+  }
+  return count;
+}
+#endif
+
+/**
+ * Picks the fastest newline scanner the CPU supports
+ *
+ * @return The newline scanner
+ */
+static NewlineFinder selectNewlineFinder(void) {
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return findNewlinesAvx2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return findNewlinesSse2;
+  }
+#endif
+  return findNewlinesScalar;
+}
+
+/**
+ * Runs uniq -d on top of the given sorted lines and writes the response
+ * to uniqLines: the first line of every run of at least two equal lines.
+ *
+ * @param lines The sorted lines you want to uniq
+ * @param linesCount The number of lines in lines
+ * @param uniqLines A pointer to the lines which were found by uniq
+ * @param uniqLinesCount A Pointer to the number of lines found by uniq
+ */
+static void uniq(Line *lines, unsigned int linesCount, Line **uniqLines, unsigned int *uniqLinesCount) {
+  phaseStart(PHASE_DEDUP);
+  *uniqLines = xmalloc(sizeof(Line) * (linesCount / 2 + 1));
+  *uniqLinesCount = 0;
+
+  unsigned int i = 0;
+  while (i + 1 < linesCount) {
+    if (stringCmp(&lines[i], &lines[i + 1]) != 0) {
+      i++;
+      continue;
+    }
+    (*uniqLines)[(*uniqLinesCount)++] = lines[i];
+    // Skip the rest of the run
+    unsigned int j = i + 2;
+    while (j < linesCount && stringCmp(&lines[i], &lines[j]) == 0) {
+      j++;
+    }
+    i = j;
+  }
+  phaseStop(PHASE_DEDUP);
+}
+
+/**
+ * Front-codes the given sorted lines
+ *
+ * @param lines The sorted lines
+ * @param linesCount The number of lines in lines
+ * @param coded Receives the entries, data is allocated here
+ */
+static void frontCode(const Line *lines, unsigned int linesCount, FrontCoded *coded) {
+  memset(coded, 0, sizeof(*coded));
+  size_t uncoded = 0;
+  for (unsigned int i = 0; i < linesCount; i++) {
+    const char *previous = i == 0 ? NULL : lineData(&lines[i - 1]);
+    size_t previousLength = i == 0 ? 0 : lines[i - 1].length;
+    frontCodeAdd(coded, previous, previousLength, lineData(&lines[i]), lines[i].length);
+    uncoded += lines[i].length;
+  }
+  if (coded->used > 0 && coded->used < coded->capacity) {
+    // Held until the merge, give the slack back
+    coded->data = xrealloc(coded->data, coded->used);
+    coded->capacity = coded->used;
+  }
+
+  // Parser threads code concurrently
+  __atomic_add_fetch(&stats.uncodedBytes, uncoded, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&stats.codedBytes, coded->used, __ATOMIC_RELAXED);
+}
+
+/**
+ * Appends a line to front-coded lines
+ *
+ * @param coded The front-coded lines
+ * @param previous The line appended before, NULL for the first one
+ * @param previousLength Number of bytes in previous
+ * @param data The line
+ * @param length Number of bytes in the line
+ */
+static void frontCodeAdd(FrontCoded *coded, const char *previous, size_t previousLength, const char *data, size_t length) {
+  size_t shared = commonPrefix(data, previous, length < previousLength ? length : previousLength);
+  size_t rest = length - shared;
+
+  // Two varints take at most 20 bytes
+  if (coded->used + rest + 20 > coded->capacity) {
+    size_t capacity = coded->capacity == 0 ? 4096 : coded->capacity;
+    while (coded->used + rest + 20 > capacity) {
+      capacity *= 2;
+    }
+    coded->data = xrealloc(coded->data, capacity);
+    coded->capacity = capacity;
+  }
+  coded->used += putVarint(coded->data + coded->used, shared);
+  coded->used += putVarint(coded->data + coded->used, rest);
+  memcpy(coded->data + coded->used, data + shared, rest);
+  coded->used += rest;
+  coded->count++;
+
+  if (length > coded->maxLength) {
+    coded->maxLength = length;
+  }
+}
+
+/**
+ * Starts decoding front-coded lines
+ *
+ * @param coded The front-coded lines
+ * @param reader Positioned before the first line, its line buffer is
+ * allocated here and freed by the caller
+ */
+static void frontCodedOpen(const FrontCoded *coded, FrontCodedReader *reader) {
+  reader->entry = coded->data;
+  reader->left = coded->count;
+  reader->line = xmalloc(coded->maxLength + 1);
+  reader->length = SIZE_MAX;
+  reader->equal = 0;
+}
+
+/**
+ * Decodes the next line. Only the bytes it does not share with the current
+ * line are copied.
+ *
+ * @param reader The reader
+ *
+ * @return 1 if there was a next line, 0 at the end
+ */
+static int frontCodedNext(FrontCodedReader *reader) {
+  if (reader->left == 0) {
+    return 0;
+  }
+  size_t shared;
+  size_t rest;
+  reader->entry += getVarint(reader->entry, &shared);
+  reader->entry += getVarint(reader->entry, &rest);
+  memcpy(reader->line + shared, reader->entry, rest);
+  reader->entry += rest;
+  reader->left--;
+
+  // A line equals its predecessor exactly if it shares all of it and adds
+  // nothing
+  reader->equal = rest == 0 && shared == reader->length;
+  reader->length = shared + rest;
+  return 1;
+}
+
+/**
+ * Decodes front-coded lines and prints them, each followed by a newline
+ *
+ * @param coded The front-coded lines
+ */
+static void printFrontCoded(const FrontCoded *coded) {
+  FrontCodedReader reader;
+  frontCodedOpen(coded, &reader);
+  while (frontCodedNext(&reader)) {
+    outputWrite(reader.line, reader.length);
+    outputWrite("\n", 1);
+  }
+  free(reader.line);
+}
+
+/**
+ * Writes a LEB128 varint: 7 bits per byte, least significant first, the
+ * high bit set on all but the last byte
+ *
+ * @param target Where to write, room for 10 bytes
+ * @param value The value to write
+ *
+ * @return The number of bytes written
+ */
+static size_t putVarint(uint8_t *target, size_t value) {
+  size_t written = 0;
+  while (value >= 0x80) {
+    target[written++] = (uint8_t) (value | 0x80);
+    value >>= 7;
+  }
+  target[written++] = (uint8_t) value;
+  return written;
+}
+
+/**
+ * Reads a varint written by putVarint()
+ *
+ * @param source Where to read
+ * @param value Receives the value
+ *
+ * @return The number of bytes read
+ */
+static size_t getVarint(const uint8_t *source, size_t *value) {
+  size_t read = 0;
+  unsigned int shift = 0;
+  *value = 0;
+  for (;;) {
+    uint8_t byte = source[read++];
+    *value |= (size_t) (byte & 0x7F) << shift;
+    if (byte < 0x80) {
+      return read;
+    }
+    shift += 7;
+  }
+}
+
+/**
+ * Merges front-coded sorted runs and reports every line which occurs more
+ * than once in the merged order, like uniq -d on the merged lines would,
+ * without writing the merged lines anywhere.
+ *
+ * The runs are decoded in place and merged through a binary heap. Runs
+ * which do not overlap, like the blocks of sorted output, keep their line
+ * at the top of the heap and cost two comparisons per line. A line which
+ * repeats the one before it in its run is recognized from its entry header
+ * alone, only lines coming from another run than their predecessor are
+ * compared.
+ *
+ * @param runs The front-coded sorted runs
+ * @param runsCount The number of elements in runs
+ * @param duplicates Receives the lines found, front-coded in order, data
+ * is allocated here
+ */
+static void mergeUniq(const FrontCoded *runs, size_t runsCount, FrontCoded *duplicates) {
+  memset(duplicates, 0, sizeof(*duplicates));
+
+  FrontCodedReader *readers = xmalloc(sizeof(FrontCodedReader) * (runsCount + 1));
+  size_t *heap = xmalloc(sizeof(size_t) * (runsCount + 1));
+  size_t heapCount = 0;
+  size_t maxLength = 0;
+  for (size_t i = 0; i < runsCount; i++) {
+    frontCodedOpen(&runs[i], &readers[i]);
+    if (frontCodedNext(&readers[i])) {
+      heap[heapCount++] = i;
+    }
+    if (runs[i].maxLength > maxLength) {
+      maxLength = runs[i].maxLength;
+    }
+  }
+  for (size_t i = heapCount / 2; i-- > 0;) {
+    mergeSiftDown(heap, heapCount, i, readers);
+  }
+
+  // The current distinct line and the last one reported
+  char *previous = xmalloc(maxLength + 1);
+  size_t previousLength = 0;
+  char *reported = xmalloc(maxLength + 1);
+  size_t reportedLength = 0;
+  int previousReported = 0;
+  // The run of the line before, runsCount before the first line
+  size_t previousRun = runsCount;
+
+  while (heapCount > 0) {
+    size_t run = heap[0];
+    FrontCodedReader *reader = &readers[run];
+
+    // Whatever came in between sorts between the line before in this run
+    // and this line, so equal neighbours in the run are equal in the merge
+    int equal = reader->equal;
+    if (!equal && run != previousRun && previousRun != runsCount) {
+      equal = bytesCmp(previous, previousLength, reader->line, reader->length) == 0;
+    }
+
+    if (!equal) {
+      memcpy(previous, reader->line, reader->length);
+      previousLength = reader->length;
+      previousReported = 0;
+    } else if (!previousReported) {
+      frontCodeAdd(duplicates, reported, reportedLength, previous, previousLength);
+      memcpy(reported, previous, previousLength);
+      reportedLength = previousLength;
+      previousReported = 1;
+    }
+    previousRun = run;
+
+    if (!frontCodedNext(reader)) {
+      heap[0] = heap[--heapCount];
+    }
+    mergeSiftDown(heap, heapCount, 0, readers);
+  }
+
+  for (size_t i = 0; i < runsCount; i++) {
+    free(readers[i].line);
+  }
+  free(readers);
+  free(heap);
+  free(previous);
+  free(reported);
+}
+
+/**
+ * Moves a run down the heap of mergeUniq() until its line is not larger
+ * than the lines of its children
+ *
+ * @param heap Indexes of the runs, the smallest current line first
+ * @param heapCount The number of elements in heap
+ * @param index The position in heap to start at
+ * @param readers The readers of the runs
+ */
+static void mergeSiftDown(size_t *heap, size_t heapCount, size_t index, const FrontCodedReader *readers) {
+  for (;;) {
+    size_t smallest = index;
+    for (size_t child = 2 * index + 1; child <= 2 * index + 2 && child < heapCount; child++) {
+      const FrontCodedReader *a = &readers[heap[child]];
+      const FrontCodedReader *b = &readers[heap[smallest]];
+      if (bytesCmp(a->line, a->length, b->line, b->length) < 0) {
+        smallest = child;
+      }
+    }
+    if (smallest == index) {
+      return;
+    }
+    size_t swap = heap[index];
+    heap[index] = heap[smallest];
+    heap[smallest] = swap;
+    index = smallest;
+  }
+}
+
+/**
+ * Prints the usage of this program and terminates with EXIT_FAILURE
+ */
+static void usage(void) {
+  (void) fprintf(stderr, "Usage: %s [-i | -s | -u | -c] [-a [-m bytes] [-e rate]] [--stats[=text|json]]\n"
+                 "         [-k F[.C][,F[.C]]] [-n] [-f] [--watch seconds]\n"
+                 "         \"command1\" \"command2\"\n"
+                 "  -i  print lines printed by both commands\n"
+                 "  -s  print lines printed by command1 but not by command2\n"
+                 "  -u  print every distinct line\n"
+                 "  -c  print duplicated lines prefixed by their count\n"
+                 "  -a  find duplicates with a Bloom filter and a second pass over a spool file\n"
+                 "  -m  memory budget of the Bloom filter, K, M and G suffixes allowed (default 64M)\n"
+                 "  -e  false positive rate of the Bloom filter (default 0.01)\n"
+                 "  -k  order the output by the given key, fields separated by blanks like sort\n"
+                 "  -n  order the output by the leading number of the key\n"
+                 "  -f  order the output ignoring case\n"
+                 "  --stats  print time, memory and I/O figures to stderr\n"
+                 "  --watch  rerun the commands every given seconds and print the changes of\n"
+                 "           the result as +line and -line, not with -a or -c\n",
+                 programName);
+  exit(EXIT_FAILURE);
+}
+
+/**
+ * Frees the lines and runs of the given collector, the bytes of the lines
+ * stay in the arena
+ *
+ * @param collector The collector you want to free
+ */
+static void collectorFree(Collector *collector) {
+  free(collector->lines);
+  for (size_t i = 0; i < collector->runsCount; i++) {
+    free(collector->runs[i].data);
+  }
+  free(collector->runs);
+}
+
+/**
+ * Runs both commands every interval seconds and prints how the result
+ * changed since the previous run: "+line" for lines which joined it and
+ * "-line" for lines which left it, in order of their first appearance.
+ * The first run prints the whole result.
+ *
+ * The distinct lines and their counts per command are kept between runs,
+ * so a run only hashes the output and updates the counts, nothing is
+ * sorted or joined again. Never returns.
+ *
+ * @param commandOne The first command
+ * @param commandTwo The second command
+ * @param mode MODE_DUPLICATES or one of the set operations
+ * @param interval Seconds to sleep between two runs
+ * @param statsFormat -1 for no statistics, 0 as text, 1 as JSON after
+ * every run
+ */
+static void watch(char *commandOne, char *commandTwo, Mode mode, double interval, int statsFormat) {
+  LineTable table;
+  tableInit(&table);
+  Watch state;
+  memset(&state, 0, sizeof(state));
+  Collector collector;
+  memset(&collector, 0, sizeof(collector));
+  collector.table = &table;
+  collector.watch = &state;
+
+  struct timespec pause;
+  pause.tv_sec = (time_t) interval;
+  pause.tv_nsec = (long) ((interval - pause.tv_sec) * 1e9);
+
+  for (;;) {
+    getLines(commandOne, 0, &collector);
+    getLines(commandTwo, 1, &collector);
+
+    phaseStart(PHASE_OUTPUT);
+    watchApply(&collector, mode);
+    outputFlush();
+    phaseStop(PHASE_OUTPUT);
+
+    if (statsFormat != -1) {
+      printStats(statsFormat);
+    }
+
+    struct timespec remaining = pause;
+    while (nanosleep(&remaining, &remaining) == -1 && errno == EINTR) {
+    }
+  }
+}
+
+/**
+ * Tells whether a line belongs to the result
+ *
+ * @param mode MODE_DUPLICATES or one of the set operations
+ * @param counts How often each command printed the line
+ *
+ * @return 1 if it does, 0 if not
+ */
+static int watchMember(Mode mode, const uint32_t counts[2]) {
+  if (mode == MODE_DUPLICATES) {
+    return counts[0] + counts[1] >= 2;
+  }
+  uint8_t sources = (counts[0] > 0 ? SOURCE_BIT(0) : 0) | (counts[1] > 0 ? SOURCE_BIT(1) : 0);
+  return sources != 0 && modeMatches(mode, sources);
+}
+
+/**
+ * Prints the lines whose membership changed in the tick just read, makes
+ * the tick's counts the current ones and drops lines neither command
+ * printed anymore once they make up half of the table.
+ *
+ * @param collector The collector of the tick
+ * @param mode MODE_DUPLICATES or one of the set operations
+ */
+static void watchApply(Collector *collector, Mode mode) {
+  Watch *state = collector->watch;
+  unsigned int dead = 0;
+  for (unsigned int i = 0; i < collector->linesCount; i++) {
+    int was = watchMember(mode, state->counts[i]);
+    int is = watchMember(mode, state->ticks[i]);
+    if (was != is) {
+      outputWrite(is ? "+" : "-", 1);
+      printLine(&collector->lines[i]);
+    }
+
+    state->counts[i][0] = state->ticks[i][0];
+    state->counts[i][1] = state->ticks[i][1];
+    state->ticks[i][0] = 0;
+    state->ticks[i][1] = 0;
+    if (state->counts[i][0] == 0 && state->counts[i][1] == 0) {
+      dead++;
+    }
+  }
+
+  if (dead > LINE_TABLE_INITIAL_CAPACITY && dead * 2 > collector->linesCount) {
+    watchCompact(collector);
+  }
+}
+
+/**
+ * Drops the lines neither command printed in the last tick: moves the
+ * remaining ones to the front of the arena and rebuilds the table.
+ *
+ * @param collector The collector to compact
+ */
+static void watchCompact(Collector *collector) {
+  Watch *state = collector->watch;
+  LineTable *table = collector->table;
+  tableFree(table);
+  tableInit(table);
+
+  // Lines were appended to the arena in order, moving them down in order
+  // never overwrites one which is still to be moved.
+  size_t used = 0;
+  unsigned int kept = 0;
+  for (unsigned int i = 0; i < collector->linesCount; i++) {
+    if (state->counts[i][0] == 0 && state->counts[i][1] == 0) {
+      continue;
+    }
+    Line line = collector->lines[i];
+    memmove(arena.base + used, lineData(&line), line.length);
+    line.offset = used;
+    used += line.length;
+
+    collector->lines[kept] = line;
+    state->counts[kept][0] = state->counts[i][0];
+    state->counts[kept][1] = state->counts[i][1];
+    state->ticks[kept][0] = 0;
+    state->ticks[kept][1] = 0;
+    tableAdd(table, collector->lines, kept, lineData(&line), line.length, hashLine(lineData(&line), line.length), 0);
+    kept++;
+  }
+
+  collector->linesCount = kept;
+  arena.used = used;
+}
+
+/**
+ * Returns the first byte of the given line
+ *
+ * @param line The line
+ *
+ * @return The line's bytes in the arena
+ */
+static inline const char *lineData(const Line *line) {
+  return arena.base + line->offset;
+}
+
+/**
+ * Reserves the arena, as large as 32 bit offsets allow if the address
+ * space permits.
+ */
+static void arenaInit(void) {
+  for (size_t size = ARENA_MAX_SIZE; size >= ARENA_MIN_SIZE; size /= 2) {
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+      continue;
+    }
+#ifdef MADV_HUGEPAGE
+    // Fewer TLB misses while sorting, not an error if unsupported
+    (void) madvise(base, size, MADV_HUGEPAGE);
+#endif
+    arena.base = base;
+    arena.size = size;
+    arena.used = 0;
+    return;
+  }
+  (void) fprintf(stderr, "mmap() call failed.\n");
+  exit(EXIT_FAILURE);
+}
+
+/**
+ * Copies a line to the end of the arena
+ *
+ * @param data The line
+ * @param length Number of bytes in the line
+ *
+ * @return The offset of the copy
+ */
+static uint32_t arenaAppend(const char *data, size_t length) {
+  if (length > arena.size - arena.used) {
+    (void) fprintf(stderr, "%s: The commands printed more than %zu bytes.\n", programName, arena.size);
+    exit(EXIT_FAILURE);
+  }
+  uint32_t offset = arena.used;
+  memcpy(arena.base + offset, data, length);
+  arena.used += length;
+  return offset;
+}
+
+/**
+ * Gives the pages which lie entirely within the given bytes of the arena
+ * back to the kernel, offsets into them become invalid. The pages at both
+ * ends may still hold bytes of their neighbours.
+ *
+ * @param offset Offset of the first byte
+ * @param length Number of bytes
+ */
+static void arenaRelease(size_t offset, size_t length) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t start = (offset + page - 1) / page * page;
+  size_t end = (offset + length) / page * page;
+  if (start < end) {
+    (void) madvise(arena.base + start, end - start, MADV_DONTNEED);
+  }
+}
+
+/**
+ * Prints the given line followed by a newline
+ *
+ * @param line The line to print
+ */
+static void printLine(const Line *line) {
+  const char *data = lineData(line);
+  // A line read in place is still followed by its newline
+  if ((size_t) line->offset + line->length < arena.size && data[line->length] == '\n') {
+    outputSlice(data, line->length + 1);
+  } else {
+    outputSlice(data, line->length);
+    outputWrite("\n", 1);
+  }
+}
+
+/**
+ * Sets up the output buffer
+ */
+static void outputInit(void) {
+  output.buffer = mmap(NULL, OUTPUT_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (output.buffer == MAP_FAILED) {
+    (void) fprintf(stderr, "mmap() call failed.\n");
+    exit(EXIT_FAILURE);
+  }
+  output.used = 0;
+  output.slicesCount = 0;
+}
+
+/**
+ * Appends a copy of bytes to the output
+ *
+ * @param data The bytes, only needed during the call
+ * @param length Number of bytes
+ */
+static void outputWrite(const char *data, size_t length) {
+  if (output.slicesCount == OUTPUT_SLICES || length > OUTPUT_BUFFER_SIZE - output.used) {
+    outputFlush();
+  }
+  if (length > OUTPUT_BUFFER_SIZE) {
+    // Huge, written before the call returns
+    outputAdd(data, length);
+    outputFlush();
+    return;
+  }
+  char *copy = output.buffer + output.used;
+  memcpy(copy, data, length);
+  output.used += length;
+  outputAdd(copy, length);
+}
+
+/**
+ * Appends bytes to the output without copying them
+ *
+ * @param data The bytes, unchanged until the output is flushed
+ * @param length Number of bytes
+ */
+static void outputSlice(const char *data, size_t length) {
+  if (length < OUTPUT_SLICE_MIN) {
+    outputWrite(data, length);
+    return;
+  }
+  if (output.slicesCount == OUTPUT_SLICES) {
+    outputFlush();
+  }
+  outputAdd(data, length);
+}
+
+/**
+ * Adds a slice to the next writev(), extends the last one if the bytes
+ * follow it. There has to be room for a slice.
+ *
+ * @param data The bytes
+ * @param length Number of bytes
+ */
+static void outputAdd(const char *data, size_t length) {
+  if (length == 0) {
+    return;
+  }
+  if (output.slicesCount > 0) {
+    struct iovec *last = &output.slices[output.slicesCount - 1];
+    if ((const char *) last->iov_base + last->iov_len == data) {
+      last->iov_len += length;
+      return;
+    }
+  }
+  output.slices[output.slicesCount].iov_base = (void *) data;
+  output.slices[output.slicesCount].iov_len = length;
+  output.slicesCount++;
+}
+
+/**
+ * Writes the gathered slices to stdout and empties the buffer
+ */
+static void outputFlush(void) {
+  struct iovec *slice = output.slices;
+  int left = output.slicesCount;
+  while (left > 0) {
+    ssize_t written = writev(STDOUT_FILENO, slice, left);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      (void) fprintf(stderr, "writev() call failed.\n");
+      exit(EXIT_FAILURE);
+    }
+    // Skip what was written, the last slice may be cut
+    while (left > 0 && (size_t) written >= slice->iov_len) {
+      written -= slice->iov_len;
+      slice++;
+      left--;
+    }
+    if (left > 0) {
+      slice->iov_base = (char *) slice->iov_base + written;
+      slice->iov_len -= written;
+    }
+  }
+  output.slicesCount = 0;
+  output.used = 0;
+}
+
+/**
+ * malloc() which terminates the program if no memory is left
+ *
+ * @param size The number of bytes to allocate
+ *
+ * @return The allocated memory
+ */
+static void *xmalloc(size_t size) {
+  // Parser threads allocate too
+  __atomic_add_fetch(&stats.allocations, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&stats.allocatedBytes, size, __ATOMIC_RELAXED);
+  void *pointer = malloc(size);
+  if (pointer == NULL) {
+    (void) fprintf(stderr, "malloc() call failed.\n");
+    exit(EXIT_FAILURE);
+  }
+  return pointer;
+}
+
+/**
+ * realloc() which terminates the program if no memory is left
+ *
+ * @param pointer The memory to resize, may be NULL
+ * @param size The new number of bytes
+ *
+ * @return The resized memory
+ */
+static void *xrealloc(void *pointer, size_t size) {
+  // Parser threads allocate too
+  __atomic_add_fetch(&stats.allocations, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&stats.allocatedBytes, size, __ATOMIC_RELAXED);
+  pointer = realloc(pointer, size);
+  if (pointer == NULL) {
+    (void) fprintf(stderr, "realloc() call failed.\n");
+    exit(EXIT_FAILURE);
+  }
+  return pointer;
+}
+
+/**
+ * calloc() which terminates the program if no memory is left
+ *
+ * @param count The number of elements to allocate
+ * @param size The size of one element
+ *
+ * @return The allocated and zeroed memory
+ */
+static void *xcalloc(size_t count, size_t size) {
+  __atomic_add_fetch(&stats.allocations, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&stats.allocatedBytes, count * size, __ATOMIC_RELAXED);
+  void *pointer = calloc(count, size);
+  if (pointer == NULL) {
+    (void) fprintf(stderr, "calloc() call failed.\n");
+    exit(EXIT_FAILURE);
+  }
+  return pointer;
+}
+
+/**
+ * Compares two lines byte by byte, a line sorts before every longer line
+ * it is a prefix of
+ *
+ * @param a The first Line
+ * @param b The second Line
+ *
+ * @return negative if a is smaller, positive if a is larger and 0 if a and b are equal
+ */
+static int stringCmp(const void *a, const void *b) {
+  const Line *la = (const Line *)a;
+  const Line *lb = (const Line *)b;
+  return bytesCmp(lineData(la), la->length, lineData(lb), lb->length);
+}
+
+/**
+ * Compares two strings byte by byte like stringCmp()
+ *
+ * @param a The first string
+ * @param aLength Number of bytes in a
+ * @param b The second string
+ * @param bLength Number of bytes in b
+ *
+ * @return negative if a is smaller, positive if a is larger and 0 if a and b are equal
+ */
+static int bytesCmp(const char *a, size_t aLength, const char *b, size_t bLength) {
+  size_t length = aLength < bLength ? aLength : bLength;
+  int result = memcmp(a, b, length);
+  if (result != 0) {
+    return result;
+  }
+  return (aLength > bLength) - (aLength < bLength);
+}
+
+/**
+ * Counts the bytes two strings have in common at their start
+ *
+ * @param a The first string
+ * @param b The second string
+ * @param limit Most bytes to compare, both strings have at least as many
+ *
+ * @return The number of equal leading bytes
+ */
+static size_t commonPrefix(const char *a, const char *b, size_t limit) {
+  size_t shared = 0;
+  // A word at a time, on little endian the first different byte holds the
+  // lowest set bit of the difference
+  while (shared + sizeof(uint64_t) <= limit) {
+    uint64_t wordA;
+    uint64_t wordB;
+    memcpy(&wordA, a + shared, sizeof(uint64_t));
+    memcpy(&wordB, b + shared, sizeof(uint64_t));
+    if (wordA != wordB) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      return shared + __builtin_ctzll(wordA ^ wordB) / 8;
+#else
+      break;
+#endif
+    }
+    shared += sizeof(uint64_t);
+  }
+  while (shared < limit && a[shared] == b[shared]) {
+    shared++;
+  }
+  return shared;
+}
+
+/**
+ * Hashes the given line with 64 bit FNV-1a
+ *
+ * @param data The line
+ * @param length Number of bytes in the line
+ *
+ * @return The hash of line
+ */
+static uint64_t hashLine(const char *data, size_t length) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (unsigned char) data[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+/**
+ * Initializes an empty table
+ *
+ * @param table The table to initialize
+ */
+static void tableInit(LineTable *table) {
+  table->capacity = LINE_TABLE_INITIAL_CAPACITY;
+  table->used = 0;
+  table->slots = xcalloc(table->capacity, sizeof(LineSlot));
+  table->sourcesCapacity = LINE_TABLE_INITIAL_CAPACITY;
+  table->sources = xmalloc(sizeof(uint8_t) * table->sourcesCapacity);
+}
+
+/**
+ * Doubles the number of slots of the given table and rehashes all entries
+ *
+ * @param table The table to grow
+ */
+static void tableGrow(LineTable *table) {
+  size_t capacity = table->capacity * 2;
+  LineSlot *slots = xcalloc(capacity, sizeof(LineSlot));
+
+  for (size_t i = 0; i < table->capacity; i++) {
+    if (table->slots[i].line == 0) {
+      continue;
+    }
+    size_t j = table->slots[i].hash & (capacity - 1);
+    while (slots[j].line != 0) {
+      j = (j + 1) & (capacity - 1);
+    }
+    slots[j] = table->slots[i];
+  }
+
+  free(table->slots);
+  table->slots = slots;
+  table->capacity = capacity;
+}
+
+/**
+ * Looks up the given line and marks it as printed by source.
+ *
+ * If the line is new it is registered as lines[linesCount], the caller
+ * has to append it to lines afterwards.
+ *
+ * @param table The table of distinct lines
+ * @param lines The distinct lines collected so far
+ * @param linesCount The number of lines in lines
+ * @param data The line to add
+ * @param length Number of bytes in the line
+ * @param hash The hash of the line
+ * @param source The index of the command which printed the line
+ *
+ * @return 1 if the line is new, 0 if it was seen before
+ */
+static int tableAdd(LineTable *table, Line *lines, unsigned int linesCount, const char *data, size_t length, uint64_t hash, unsigned int source) {
+  // Keep the load factor below 0.7
+  if ((table->used + 1) * 10 > table->capacity * 7) {
+    tableGrow(table);
+  }
+
+  size_t i = hash & (table->capacity - 1);
+  while (table->slots[i].line != 0) {
+    LineSlot *slot = &table->slots[i];
+    Line *line = &lines[slot->line - 1];
+    if (slot->hash == hash && line->length == length && memcmp(lineData(line), data, length) == 0) {
+      table->sources[slot->line - 1] |= SOURCE_BIT(source);
+      slot->count++;
+      return 0;
+    }
+    i = (i + 1) & (table->capacity - 1);
+  }
+
+  if (linesCount >= table->sourcesCapacity) {
+    table->sourcesCapacity *= 2;
+    table->sources = xrealloc(table->sources, sizeof(uint8_t) * table->sourcesCapacity);
+  }
+
+  table->slots[i].hash = hash;
+  table->slots[i].line = linesCount + 1;
+  table->slots[i].count = 1;
+  table->sources[linesCount] = SOURCE_BIT(source);
+  table->used++;
+  return 1;
+}
+
+/**
+ * Looks up the given line
+ *
+ * @param table The table of distinct lines
+ * @param lines The distinct lines referenced by table
+ * @param data The line to look up
+ * @param length Number of bytes in the line
+ * @param hash The hash of the line
+ *
+ * @return The slot of the line or NULL if it is not in the table
+ */
+static LineSlot *tableFind(LineTable *table, Line *lines, const char *data, size_t length, uint64_t hash) {
+  size_t i = hash & (table->capacity - 1);
+  while (table->slots[i].line != 0) {
+    LineSlot *slot = &table->slots[i];
+    Line *line = &lines[slot->line - 1];
+    if (slot->hash == hash && line->length == length && memcmp(lineData(line), data, length) == 0) {
+      return slot;
+    }
+    i = (i + 1) & (table->capacity - 1);
+  }
+  return NULL;
+}
+
+/**
+ * Frees the memory held by the given table (but not the lines)
+ *
+ * @param table The table to free
+ */
+static void tableFree(LineTable *table) {
+  free(table->slots);
+  free(table->sources);
+}
+
+/**
+ * Checks whether a line with the given source mask belongs to the output
+ * of the given set operation
+ *
+ * @param mode The set operation
+ * @param sources The source mask of the line
+ *
+ * @return 1 if the line should be printed, 0 otherwise
+ */
+static int modeMatches(Mode mode, uint8_t sources) {
+  switch (mode) {
+    case MODE_INTERSECT:
+      return sources == SOURCE_BOTH;
+    case MODE_SUBTRACT:
+      return sources == SOURCE_BIT(0);
+    case MODE_UNION:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+/**
+ * Prints every line of the table that was seen more than once, sorted like
+ * sort | uniq -d and optionally prefixed by its count like uniq -dc does.
+ *
+ * The duplicated slots are moved to the front of the table and sorted in
+ * place, so the table is unusable afterwards.
+ *
+ * @param table The table of distinct lines
+ * @param lines The distinct lines referenced by table
+ * @param showCounts 1 to prefix every line with its count
+ */
+static void printDuplicates(LineTable *table, Line *lines, int showCounts) {
+  size_t duplicates = 0;
+  for (size_t i = 0; i < table->capacity; i++) {
+    if (table->slots[i].line != 0 && table->slots[i].count > 1) {
+      table->slots[duplicates++] = table->slots[i];
+    }
+  }
+
+  phaseStart(PHASE_SORT);
+  // Slot of every duplicated line in output order
+  uint32_t *order = xmalloc(sizeof(uint32_t) * (duplicates + 1));
+  if (sortKey.enabled) {
+    Line *duplicateLines = xmalloc(sizeof(Line) * (duplicates + 1));
+    for (size_t i = 0; i < duplicates; i++) {
+      duplicateLines[i] = lines[table->slots[i].line - 1];
+    }
+    sortKeyed(duplicateLines, duplicates, order);
+    free(duplicateLines);
+  } else {
+    slotCmpLines = lines;
+    qsort(table->slots, duplicates, sizeof(LineSlot), slotCmp);
+    for (size_t i = 0; i < duplicates; i++) {
+      order[i] = i;
+    }
+  }
+  phaseStop(PHASE_SORT);
+
+  phaseStart(PHASE_OUTPUT);
+  for (size_t i = 0; i < duplicates; i++) {
+    LineSlot *slot = &table->slots[order[i]];
+    if (showCounts) {
+      char count[16];
+      int length = snprintf(count, sizeof(count), "%7u ", (unsigned int) slot->count);
+      outputWrite(count, length);
+    }
+    printLine(&lines[slot->line - 1]);
+  }
+  free(order);
+  outputFlush();
+  phaseStop(PHASE_OUTPUT);
+}
+
+/**
+ * Compares the lines of two table slots
+ *
+ * @param a The first slot
+ * @param b The second slot
+ *
+ * @return negative if the line of a is smaller, positive if it is larger and 0 if both are equal
+ */
+static int slotCmp(const void *a, const void *b) {
+  const LineSlot *sa = (const LineSlot *)a;
+  const LineSlot *sb = (const LineSlot *)b;
+  return stringCmp(&slotCmpLines[sa->line - 1], &slotCmpLines[sb->line - 1]);
+}
+
+/**
+ * Allocates an empty Bloom filter
+ *
+ * The filter takes up to budget bytes. The number of bits per line follows
+ * from the false positive rate, the number of lines the filter holds at
+ * that rate follows from both.
+ *
+ * @param filter The filter to initialize
+ * @param budget The memory budget in bytes
+ * @param rate The false positive rate
+ */
+static void bloomInit(BloomFilter *filter, size_t budget, double rate) {
+  // Optimal number of bits per line is log2(1 / rate)
+  unsigned int hashes = 1;
+  for (double p = 0.5; p > rate && hashes < BLOOM_MAX_HASHES; p /= 2) {
+    hashes++;
+  }
+
+  filter->blocksCount = budget / BLOOM_BLOCK_SIZE;
+  filter->hashes = hashes;
+  // With the optimal number of bits per line, bits / lines = hashes / ln 2
+  filter->capacity = (size_t) (filter->blocksCount * BLOOM_BLOCK_BITS * 0.6931 / hashes);
+  filter->added = 0;
+
+  filter->blocks = mmap(NULL, filter->blocksCount * BLOOM_BLOCK_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (filter->blocks == MAP_FAILED) {
+    (void) fprintf(stderr, "mmap() call failed.\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/**
+ * Adds a line to the filter
+ *
+ * @param filter The filter
+ * @param hash The hash of the line
+ *
+ * @return 1 if the line was (probably) added before, 0 if it is new
+ */
+static int bloomAdd(BloomFilter *filter, uint64_t hash) {
+  // Upper half picks the block, lower half the bits in it
+  uint64_t *block = filter->blocks[((hash >> 32) * filter->blocksCount) >> 32];
+  uint32_t bit = (uint32_t) hash;
+  uint32_t step = (uint32_t) ((hash * 0x9e3779b97f4a7c15ULL) >> 32) | 1;
+
+  int seen = 1;
+  for (unsigned int i = 0; i < filter->hashes; i++) {
+    uint32_t b = bit % BLOOM_BLOCK_BITS;
+    uint64_t mask = 1ULL << (b % 64);
+    if ((block[b / 64] & mask) == 0) {
+      block[b / 64] |= mask;
+      seen = 0;
+    }
+    bit += step;
+  }
+
+  if (!seen) {
+    filter->added++;
+    if (filter->added == filter->capacity + 1) {
+      (void) fprintf(stderr, "%s: Bloom filter over capacity, more lines than usual will be kept. Raise -m.\n",
+                     programName);
+    }
+  }
+  return seen;
+}
+
+/**
+ * Frees the memory held by the given filter
+ *
+ * @param filter The filter to free
+ */
+static void bloomFree(BloomFilter *filter) {
+  munmap(filter->blocks, filter->blocksCount * BLOOM_BLOCK_SIZE);
+}
+
+/**
+ * Second pass of the approximate mode. Counts exactly how often every
+ * candidate kept by the first pass occurs in the spool, false positives of
+ * the filter end up with a count of one.
+ *
+ * @param collector The collector after the first pass
+ */
+static void confirmCandidates(Collector *collector) {
+  LineTable *table = collector->table;
+  for (size_t i = 0; i < table->capacity; i++) {
+    table->slots[i].count = 0;
+  }
+
+  if (fflush(collector->spool) == EOF || lseek(fileno(collector->spool), 0, SEEK_SET) == -1) {
+    (void) fprintf(stderr, "Rewinding the spool failed.\n");
+    exit(EXIT_FAILURE);
+  }
+  readLines(fileno(collector->spool), 0, confirmLine, collector);
+}
+
+/**
+ * Parses the argument of -k into sortKey
+ *
+ * @param key F[.C][,F[.C]] like sort, fields and characters counted from 1
+ *
+ * @return 1 if successful, 0 if the key is malformed
+ */
+static int parseKey(const char *key) {
+  char *end;
+  unsigned long startField = strtoul(key, &end, 10);
+  unsigned long startChar = 1;
+  unsigned long endField = 0;
+  unsigned long endChar = 0;
+  if (*end == '.') {
+    startChar = strtoul(end + 1, &end, 10);
+  }
+  if (*end == ',') {
+    endField = strtoul(end + 1, &end, 10);
+    if (endField == 0) {
+      return 0;
+    }
+    if (*end == '.') {
+      endChar = strtoul(end + 1, &end, 10);
+    }
+  }
+  if (end == key || *end != '\0' || startField == 0 || startChar == 0
+      || startField > UINT32_MAX || startChar > UINT32_MAX || endField > UINT32_MAX || endChar > UINT32_MAX) {
+    return 0;
+  }
+  sortKey.startField = startField;
+  sortKey.startChar = startChar;
+  sortKey.endField = endField;
+  sortKey.endChar = endChar;
+  return 1;
+}
+
+/**
+ * Sorts lines by sortKey without moving them
+ *
+ * @param lines The lines
+ * @param linesCount The number of lines in lines
+ * @param order Receives the index of every line in lines, in sorted order
+ */
+static void sortKeyed(Line *lines, unsigned int linesCount, uint32_t *order) {
+  KeyedLine *keys = xmalloc(sizeof(KeyedLine) * (linesCount + 1));
+  for (unsigned int i = 0; i < linesCount; i++) {
+    keys[i] = makeKey(&lines[i], i);
+  }
+
+  keyCmpLines = lines;
+  qsort(keys, linesCount, sizeof(KeyedLine), keyCmp);
+
+  for (unsigned int i = 0; i < linesCount; i++) {
+    order[i] = keys[i].line;
+  }
+  free(keys);
+}
+
+/**
+ * Extracts the sort key of a line
+ *
+ * @param line The line
+ * @param index Index of the line in the lines being sorted
+ *
+ * @return The line's key
+ */
+static KeyedLine makeKey(const Line *line, uint32_t index) {
+  const char *data = lineData(line);
+  size_t length = line->length;
+
+  size_t start = 0;
+  for (unsigned int field = 1; field < sortKey.startField; field++) {
+    start = skipField(data, length, start);
+  }
+  start = start + sortKey.startChar - 1 < length ? start + sortKey.startChar - 1 : length;
+
+  size_t end = length;
+  if (sortKey.endField != 0) {
+    end = 0;
+    for (unsigned int field = 1; field < sortKey.endField; field++) {
+      end = skipField(data, length, end);
+    }
+    if (sortKey.endChar == 0) {
+      end = skipField(data, length, end);
+    } else {
+      end = end + sortKey.endChar < length ? end + sortKey.endChar : length;
+    }
+    if (end < start) {
+      end = start;
+    }
+  }
+
+  KeyedLine key;
+  key.prefix = 0;
+  key.keyOffset = line->offset + start;
+  key.keyLength = end - start;
+  key.line = index;
+
+  if (sortKey.numeric) {
+    // Leading blanks, an optional minus and digits with an optional
+    // decimal point, like sort -n. Anything else counts as 0.
+    size_t i = start;
+    while (i < end && (data[i] == ' ' || data[i] == '\t')) {
+      i++;
+    }
+    char number[64];
+    size_t numberLength = 0;
+    int point = 0;
+    if (i < end && data[i] == '-') {
+      number[numberLength++] = data[i++];
+    }
+    while (i < end && numberLength < sizeof(number) - 1
+           && (isdigit((unsigned char) data[i]) || (data[i] == '.' && !point))) {
+      point |= data[i] == '.';
+      number[numberLength++] = data[i++];
+    }
+    number[numberLength] = '\0';
+    double value = strtod(number, NULL);
+    if (value == 0) {
+      // -0 sorts like 0
+      value = 0;
+    }
+
+    // Set the sign bit of positive numbers and flip every bit of negative
+    // ones, the bits then sort like the numbers.
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    key.prefix = bits >> 63 ? ~bits : bits | (UINT64_C(1) << 63);
+    key.keyLength = 0;
+    return key;
+  }
+
+  for (size_t i = 0; i < 8; i++) {
+    unsigned char byte = 0;
+    if (i < key.keyLength) {
+      byte = data[start + i];
+      if (sortKey.fold) {
+        byte = toupper(byte);
+      }
+    }
+    key.prefix = key.prefix << 8 | byte;
+  }
+  return key;
+}
+
+/**
+ * Skips to the end of a field. Fields are separated like sort does without
+ * -t: every field but the first starts with the blanks before it.
+ *
+ * @param data The line
+ * @param length Number of bytes in the line
+ * @param position Start of the field
+ *
+ * @return Start of the next field, length at the end of the line
+ */
+static size_t skipField(const char *data, size_t length, size_t position) {
+  while (position < length && (data[position] == ' ' || data[position] == '\t')) {
+    position++;
+  }
+  while (position < length && data[position] != ' ' && data[position] != '\t') {
+    position++;
+  }
+  return position;
+}
+
+/**
+ * Compares two keyed lines for qsort(): by key, then by the whole line
+ * like the last resort comparison of sort
+ *
+ * @param a The first KeyedLine
+ * @param b The second KeyedLine
+ *
+ * @return <0, 0 or >0 like strcmp
+ */
+static int keyCmp(const void *a, const void *b) {
+  const KeyedLine *ka = (const KeyedLine *)a;
+  const KeyedLine *kb = (const KeyedLine *)b;
+  if (ka->prefix != kb->prefix) {
+    return ka->prefix < kb->prefix ? -1 : 1;
+  }
+
+  // The first 8 bytes are equal, compare the rest of the keys
+  const unsigned char *da = (const unsigned char *) arena.base + ka->keyOffset;
+  const unsigned char *db = (const unsigned char *) arena.base + kb->keyOffset;
+  uint32_t length = ka->keyLength < kb->keyLength ? ka->keyLength : kb->keyLength;
+  for (uint32_t i = 8; i < length; i++) {
+    int ca = sortKey.fold ? toupper(da[i]) : da[i];
+    int cb = sortKey.fold ? toupper(db[i]) : db[i];
+    if (ca != cb) {
+      return ca - cb;
+    }
+  }
+  if (ka->keyLength != kb->keyLength) {
+    return ka->keyLength < kb->keyLength ? -1 : 1;
+  }
+
+  return stringCmp(&keyCmpLines[ka->line], &keyCmpLines[kb->line]);
+}
+
+/**
+ * Parses a size in bytes with an optional K, M or G suffix
+ *
+ * @param size The size, e.g. "512M"
+ *
+ * @return The size in bytes, 0 if it is invalid
+ */
+static size_t parseSize(const char *size) {
+  if (!isdigit((unsigned char) *size)) {
+    // strtoul() would accept blanks and a sign
+    return 0;
+  }
+  char *end;
+  errno = 0;
+  unsigned long value = strtoul(size, &end, 10);
+  if (errno == ERANGE || value > SIZE_MAX) {
+    return 0;
+  }
+  size_t multiplier = 1;
+  switch (toupper((unsigned char) *end)) {
+    case 'G':
+      multiplier *= 1024;
+      // fall through
+    case 'M':
+      multiplier *= 1024;
+      // fall through
+    case 'K':
+      multiplier *= 1024;
+      end++;
+      break;
+    default:
+      break;
+  }
+  if (*end != '\0' || value > SIZE_MAX / multiplier) {
+    return 0;
+  }
+  return value * multiplier;
+}
+
+/**
+ * Returns the current time of the given clock in seconds
+ *
+ * @param clock The clock to read
+ *
+ * @return The time in seconds
+ */
+static double clockSeconds(clockid_t clock) {
+  struct timespec now;
+  if (clock_gettime(clock, &now) == -1) {
+    return 0;
+  }
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ * Starts measuring the given phase for --stats
+ *
+ * @param phase The phase which starts
+ */
+static void phaseStart(Phase phase) {
+  stats.wallStarted[phase] = clockSeconds(CLOCK_MONOTONIC);
+  stats.cpuStarted[phase] = clockSeconds(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+/**
+ * Stops measuring the given phase and adds the time spent to its total
+ *
+ * @param phase The phase which ends
+ */
+static void phaseStop(Phase phase) {
+  stats.wall[phase] += clockSeconds(CLOCK_MONOTONIC) - stats.wallStarted[phase];
+  stats.cpu[phase] += clockSeconds(CLOCK_PROCESS_CPUTIME_ID) - stats.cpuStarted[phase];
+}
+
+/**
+ * Prints the figures collected during the run to stderr
+ *
+ * @param json 1 to print a single JSON object, 0 for a table
+ */
+static void printStats(int json) {
+  struct rusage self;
+  struct rusage children;
+  if (getrusage(RUSAGE_SELF, &self) == -1 || getrusage(RUSAGE_CHILDREN, &children) == -1) {
+    (void) fprintf(stderr, "getrusage() call failed.\n");
+    return;
+  }
+  double childrenCpu = children.ru_utime.tv_sec + children.ru_utime.tv_usec / 1e6
+                       + children.ru_stime.tv_sec + children.ru_stime.tv_usec / 1e6;
+
+  if (json) {
+    (void) fprintf(stderr, "{\"phases\":{");
+    for (int i = 0; i < PHASE_COUNT; i++) {
+      (void) fprintf(stderr, "%s\"%s\":{\"wall\":%.6f,\"cpu\":%.6f}",
+                     i == 0 ? "" : ",", phaseNames[i], stats.wall[i], stats.cpu[i]);
+    }
+    (void) fprintf(stderr, "},\"sources\":[");
+    for (int i = 0; i < 2; i++) {
+      (void) fprintf(stderr, "%s{\"bytes\":%llu,\"lines\":%llu}", i == 0 ? "" : ",",
+                     (unsigned long long) stats.bytes[i], (unsigned long long) stats.lines[i]);
+    }
+    (void) fprintf(stderr, "],\"commands_cpu\":%.6f,\"peak_rss_kib\":%ld,"
+                   "\"allocations\":%llu,\"allocated_bytes\":%llu,"
+                   "\"uncoded_bytes\":%llu,\"coded_bytes\":%llu}\n",
+                   childrenCpu, self.ru_maxrss, (unsigned long long) stats.allocations,
+                   (unsigned long long) stats.allocatedBytes, (unsigned long long) stats.uncodedBytes,
+                   (unsigned long long) stats.codedBytes);
+    return;
+  }
+
+  (void) fprintf(stderr, "%-8s %12s %12s\n", "phase", "wall [s]", "cpu [s]");
+  for (int i = 0; i < PHASE_COUNT; i++) {
+    (void) fprintf(stderr, "%-8s %12.6f %12.6f\n", phaseNames[i], stats.wall[i], stats.cpu[i]);
+  }
+  for (int i = 0; i < 2; i++) {
+    (void) fprintf(stderr, "command%d: %llu bytes, %llu lines\n", i + 1,
+                   (unsigned long long) stats.bytes[i], (unsigned long long) stats.lines[i]);
+  }
+  (void) fprintf(stderr, "commands cpu: %.6f s\n", childrenCpu);
+  (void) fprintf(stderr, "peak rss: %ld KiB\n", self.ru_maxrss);
+  (void) fprintf(stderr, "allocations: %llu (%llu bytes)\n",
+                 (unsigned long long) stats.allocations, (unsigned long long) stats.allocatedBytes);
+  if (stats.uncodedBytes > 0) {
+    (void) fprintf(stderr, "front coding: %llu -> %llu bytes\n",
+                   (unsigned long long) stats.uncodedBytes, (unsigned long long) stats.codedBytes);
+  }
 }
@@ -7,140 +7,642 @@
  */
 
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
 #define SHM_NAME "/1528624_memory.mem"
 #define SHM_MAX_DATA (1024)
 #define SHM_PERMISSION (0600)
 
-#define SHM_END_BYTE (0xFF)
+/// Number of clients which can be connected at the same time
+#define SHM_SLOTS (64)
+
+/// State of a slot nobody owns, otherwise the state is the owner's pid
+#define SLOT_FREE (0)
+
+/// Server threads at most, each one serves its own share of the slots
+#define MAX_WORKERS (SHM_SLOTS)
+
+/// Messages a ring holds, a power of two
+#define RING_SIZE (4)
+
+/// Polls of a ring or the doorbell before going to sleep on a futex
+#define SPIN_LIMIT (4000)
+
+/// Version of the message format, a server rejects other versions
+#define PROTOCOL_VERSION (2)
 
 #define SHM_SUCCESS_BYTE (0x00)
 #define SHM_ERROR_BYTE (0x01)
 #define SHM_END_REACHED_BYTE (0x02)
 
+/// Client ids are handles, HANDLE_INDEX_BITS of index and a generation
+#define HANDLE_INDEX_BITS (20)
+#define HANDLE_INDEX_MASK ((1U << HANDLE_INDEX_BITS) - 1)
+#define HANDLE_GENERATIONS (1U << (32 - HANDLE_INDEX_BITS))
+/// No valid handle, the client id before the first submit
+#define HANDLE_NONE (0)
+
+/// Flag of a message which continues in the next one, a streamed response
+/// or a submitted chunk with more to append
+#define MESSAGE_MORE (0x0001)
+
+/**
+ * Starts every message, the payload follows directly.
+ */
+typedef struct {
+  // PROTOCOL_VERSION
+  uint8_t version;
+  // Request: command, response: status
+  uint8_t opcode;
+  // MESSAGE_MORE
+  uint16_t flags;
+  // Handle returned by submit, sent with every later request
+  uint32_t clientId;
+  // Numbers the requests of a client, responses repeat it
+  uint32_t sequence;
+  // Bytes of payload
+  uint32_t length;
+} MessageHeader;
+
+#define SHM_MAX_PAYLOAD (SHM_MAX_DATA - sizeof(MessageHeader))
+
 typedef struct {
-  // 0 idle, 1 used, debugging...
-  uint8_t state;
-  // First byte: command (or response status), rest is free for needed data.
-  uint8_t data[SHM_MAX_DATA];
+  MessageHeader header;
+  uint8_t payload[SHM_MAX_PAYLOAD];
+} Message;
+
+/**
+ * Lock free ring of messages with a single producer and a single consumer.
+ *
+ * The producer fills the entry at head and publishes it by incrementing
+ * head, the consumer reads the entry at tail and hands it back by
+ * incrementing tail. Both only grow and wrap around at 2^32. A side which
+ * has to wait spins for a while, then sleeps on the other side's index.
+ */
+typedef struct {
+  // Next entry to fill, only written by the producer. Futex word.
+  uint32_t head;
+  // 1 while the consumer sleeps on head.
+  uint32_t headSleeping;
+  // Next entry to read, only written by the consumer. Futex word.
+  uint32_t tail;
+  // 1 while the producer sleeps on tail.
+  uint32_t tailSleeping;
+  Message entries[RING_SIZE];
+} Ring;
+
+/**
+ * The private channel of one client. A client claims a free slot, or the
+ * slot of a client which died, when it starts and keeps it until it quits,
+ * nobody else touches its rings.
+ */
+typedef struct {
+  // SLOT_FREE or the pid of the owner, claimed with a compare and swap.
+  uint32_t state;
+  // Doorbell of the server thread serving this slot, set by the server.
+  uint32_t doorbell;
+  // Incremented by every new owner, asks the server to reset the slot.
+  uint32_t epoch;
+  // The epoch the server reset the slot for. Futex word the owner waits
+  // on before its first request.
+  uint32_t ready;
+  // Submission ring, client to server.
+  Ring requests;
+  // Completion ring, server to client.
+  Ring responses;
+} Slot;
+
+/**
+ * Wakes one server thread. Each one gets its own cache line, so ringing
+ * one does not slow down the others.
+ */
+typedef struct {
+  // Incremented after every request. Futex word the server thread sleeps on.
+  uint32_t value;
+  // 1 while the server thread sleeps on the doorbell.
+  uint32_t sleeping;
+} __attribute__((aligned(64))) Doorbell;
+
+typedef struct {
+  Doorbell doorbells[MAX_WORKERS];
+  Slot slots[SHM_SLOTS];
 } SharedMemory;
 
-#define SEM_1 "/1528624_sem_1.sem"
-#define SEM_2 "/1528624_sem_2.sem"
-#define SEM_3 "/1528624_sem_3.sem"
-#define SEM_4 "/1528624_sem_4.sem"
+/// 1 if waiting sides should spin before they sleep, 0 on one CPU
+static int spinning = -1;
+
+/**
+ * Sleeps until *word is woken up, unless it differs from value already.
+ */
+static inline void futexWait(uint32_t *word, uint32_t value) {
+  if (syscall(SYS_futex, word, FUTEX_WAIT, value, NULL, NULL, 0) == -1
+      && errno != EAGAIN && errno != EINTR) {
+    perror("futex");
+    _exit(EXIT_FAILURE);
+  }
+}
+
+/**
+ * Wakes everybody sleeping on word.
+ */
+static inline void futexWake(uint32_t *word) {
+  if (syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0) == -1) {
+    perror("futex");
+    _exit(EXIT_FAILURE);
+  }
+}
+
+/**
+ * One step of a busy wait. Returns 0 once the caller should sleep instead.
+ */
+static inline int spin(int *spins) {
+  // Relaxed, server threads may race to store the same value
+  int enabled = __atomic_load_n(&spinning, __ATOMIC_RELAXED);
+  if (enabled == -1) {
+    // Spinning only helps if the other side runs meanwhile
+    enabled = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+    __atomic_store_n(&spinning, enabled, __ATOMIC_RELAXED);
+  }
+  if (!enabled || ++*spins > SPIN_LIMIT) {
+    return 0;
+  }
+#if defined(__x86_64__) || defined(__i386__)
+  __asm__ __volatile__("pause");
+#endif
+  return 1;
+}
+
+/**
+ * Consumer: the entry at tail, NULL if the ring is empty.
+ */
+static inline Message *ringPeek(Ring *ring) {
+  uint32_t tail = ring->tail;
+  if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail) {
+    return NULL;
+  }
+  return &ring->entries[tail % RING_SIZE];
+}
+
+/**
+ * Consumer: the entry at tail, waits until there is one.
+ */
+static inline Message *ringWaitPeek(Ring *ring) {
+  int spins = 0;
+  for (;;) {
+    Message *entry = ringPeek(ring);
+    if (entry != NULL) {
+      return entry;
+    }
+    if (spin(&spins)) {
+      continue;
+    }
+    // Announce the sleep before the last look, the producer checks the
+    // flag after publishing.
+    __atomic_store_n(&ring->headSleeping, 1, __ATOMIC_SEQ_CST);
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+    if (head == ring->tail) {
+      futexWait(&ring->head, head);
+    }
+    __atomic_store_n(&ring->headSleeping, 0, __ATOMIC_SEQ_CST);
+  }
+}
+
+/**
+ * Consumer: hands the entry at tail back to the producer.
+ */
+static inline void ringPop(Ring *ring) {
+  __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&ring->tailSleeping, __ATOMIC_SEQ_CST)) {
+    futexWake(&ring->tail);
+  }
+}
+
+/**
+ * Producer: the entry at head, NULL if the ring is full.
+ */
+static inline Message *ringReserve(Ring *ring) {
+  uint32_t head = ring->head;
+  if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == RING_SIZE) {
+    return NULL;
+  }
+  return &ring->entries[head % RING_SIZE];
+}
+
+/**
+ * Producer: the entry at head, waits until there is room.
+ */
+static inline Message *ringWaitReserve(Ring *ring) {
+  int spins = 0;
+  for (;;) {
+    Message *entry = ringReserve(ring);
+    if (entry != NULL) {
+      return entry;
+    }
+    if (spin(&spins)) {
+      continue;
+    }
+    __atomic_store_n(&ring->tailSleeping, 1, __ATOMIC_SEQ_CST);
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+    if (ring->head - tail == RING_SIZE) {
+      futexWait(&ring->tail, tail);
+    }
+    __atomic_store_n(&ring->tailSleeping, 0, __ATOMIC_SEQ_CST);
+  }
+}
+
+/**
+ * Producer: publishes the entry at head.
+ */
+static inline void ringPush(Ring *ring) {
+  __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&ring->headSleeping, __ATOMIC_SEQ_CST)) {
+    futexWake(&ring->head);
+  }
+}
+
+/**
+ * Tells the server thread serving a slot that one of its rings changed.
+ */
+static inline void ringDoorbell(SharedMemory *memory, const Slot *slot) {
+  Doorbell *doorbell = &memory->doorbells[slot->doorbell % MAX_WORKERS];
+  __atomic_add_fetch(&doorbell->value, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&doorbell->sleeping, __ATOMIC_SEQ_CST)) {
+    futexWake(&doorbell->value);
+  }
+}
 
 #define AMINO_STOP (0xFE)
 #define AMINO_START 'M'
 
-uint8_t getAminoAcid(uint8_t f, uint8_t s, uint8_t t) {
-  if (f == 'U') {
-    if (s == 'U') {
-      if (t == 'U') {
-        return 'F';
-      } else if (t == 'C') {
-        return 'F';
-      } else if (t == 'A') {
-        return 'L';
-      } else if (t == 'G') {
-        return 'L';
-      }
-    } else if (s == 'C') {
-      return 'S';
-    } else if (s == 'A') {
-      if (t == 'U') {
-        return 'Y';
-      } else if (t == 'C') {
-        return 'Y';
-      } else if (t == 'A') {
-        return AMINO_STOP;
-      } else if (t == 'G') {
-        return AMINO_STOP;
-      }
-    } else if (s == 'G') {
-      if (t == 'U') {
-        return 'C';
-      } else if (t == 'C') {
-        return 'C';
-      } else if (t == 'A') {
-        return AMINO_STOP;
-      } else if (t == 'G') {
-        return 'W';
-      }
-    }
-  } else if (f == 'C') {
-    if (s == 'U') {
-      return 'L';
-    } else if (s == 'C') {
-      return 'P';
-    } else if (s == 'A') {
-      if (t == 'U') {
-        return 'H';
-      } else if (t == 'C') {
-        return 'H';
-      } else if (t == 'A') {
-        return 'Q';
-      } else if (t == 'G') {
-        return 'Q';
-      }
-    } else if (s == 'G') {
-      return 'R';
-    }
-  } else if (f == 'A') {
-    if (s == 'U') {
-      if (t == 'U') {
-        return 'I';
-      } else if (t == 'C') {
-        return 'I';
-      } else if (t == 'A') {
-        return 'I';
-      } else if (t == 'G') {
-        return AMINO_START;
-      }
-    } else if (s == 'C') {
-      return 'T';
-    } else if (s == 'A') {
-      if (t == 'U') {
-        return 'N';
-      } else if (t == 'C') {
-        return 'N';
-      } else if (t == 'A') {
-        return 'K';
-      } else if (t == 'G') {
-        return 'K';
-      }
-    } else if (s == 'G') {
-      if (t == 'U') {
-        return 'S';
-      } else if (t == 'C') {
-        return 'S';
-      } else if (t == 'A') {
-        return 'R';
-      } else if (t == 'G') {
-        return 'R';
-      }
-    }
-  } else if (f == 'G') {
-    if (s == 'U') {
-      return 'V';
-    } else if (s == 'C') {
-      return 'A';
-    } else if (s == 'A') {
-      if (t == 'U') {
-        return 'D';
-      } else if (t == 'C') {
-        return 'D';
-      } else if (t == 'A') {
-        return 'E';
-      } else if (t == 'G') {
-        return 'E';
-      }
-    } else if (s == 'G') {
-      return 'G';
+/// Set in NUCLEOTIDE_CODES for the four valid nucleotides
+#define NUCLEOTIDE_VALID (0x04)
+
+/**
+ * 2-bit code of each nucleotide (A = 0, C = 1, G = 2, U = 3) plus
+ * NUCLEOTIDE_VALID, 0 for every other byte.
+ */
+static const uint8_t NUCLEOTIDE_CODES[256] = {
+  ['A'] = NUCLEOTIDE_VALID | 0,
+  ['C'] = NUCLEOTIDE_VALID | 1,
+  ['G'] = NUCLEOTIDE_VALID | 2,
+  ['U'] = NUCLEOTIDE_VALID | 3,
+};
+
+/**
+ * Amino acid of each codon, indexed by the 2-bit codes of its nucleotides
+ * as first << 4 | second << 2 | third.
+ */
+static const uint8_t CODON_TABLE[64] = {
+  // AA.        AC.        AG.             AU.
+  'K', 'N', 'K', 'N',  'T', 'T', 'T', 'T',  'R', 'S', 'R', 'S',  'I', 'I', 'M', 'I',
+  // CA.        CC.        CG.             CU.
+  'Q', 'H', 'Q', 'H',  'P', 'P', 'P', 'P',  'R', 'R', 'R', 'R',  'L', 'L', 'L', 'L',
+  // GA.        GC.        GG.             GU.
+  'E', 'D', 'E', 'D',  'A', 'A', 'A', 'A',  'G', 'G', 'G', 'G',  'V', 'V', 'V', 'V',
+  // UA.                              UC.       UG.                  UU.
+  AMINO_STOP, 'Y', AMINO_STOP, 'Y',  'S', 'S', 'S', 'S',  AMINO_STOP, 'C', 'W', 'C',  'L', 'F', 'L', 'F',
+};
+
+/**
+ * Translates one codon.
+ * @return The amino acid, AMINO_STOP or 0 if a nucleotide is invalid.
+ */
+static inline uint8_t getAminoAcid(uint8_t f, uint8_t s, uint8_t t) {
+  uint8_t cf = NUCLEOTIDE_CODES[f];
+  uint8_t cs = NUCLEOTIDE_CODES[s];
+  uint8_t ct = NUCLEOTIDE_CODES[t];
+  if (!(cf & cs & ct & NUCLEOTIDE_VALID)) {
+    return 0;
+  }
+  return CODON_TABLE[(cf & 3) << 4 | (cs & 3) << 2 | (ct & 3)];
+}
+
+/// 6-bit window of AUG in PackedMrna order, first base lowest
+#define PACKED_AUG (0 | 3 << 2 | 2 << 4)
+
+/// Bytes after the bases of a PackedMrna, so windows can always be loaded
+#define PACKED_PADDING (16)
+
+/// Bit 2 * k of a window for the k < 24 with k % 3 == frame
+static const uint64_t PACKED_FRAMES[3] = { 0x041041041041ULL, 0x104104104104ULL, 0x410410410410ULL };
+
+/**
+ * A sequence at 2 bits per base. Base i is in byte i / 4 at bit 2 * (i % 4),
+ * the code is the one of NUCLEOTIDE_CODES.
+ */
+typedef struct {
+  uint8_t *bases;
+  uint32_t length;
+  // Allocated bytes, at least length / 4 + 1 + PACKED_PADDING.
+  uint32_t capacity;
+} PackedMrna;
+
+/**
+ * Appends nucleotides, growing the buffer geometrically. A zeroed
+ * PackedMrna is empty.
+ * @return 0 on success, -1 if a byte is no nucleotide or realloc failed,
+ *         mrna is unchanged then.
+ */
+static inline int appendMrna(PackedMrna *mrna, const uint8_t *nucleotides, uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    if (!(NUCLEOTIDE_CODES[nucleotides[i]] & NUCLEOTIDE_VALID)) {
+      return -1;
     }
   }
+  if (count > UINT32_MAX - mrna->length - 4 * (PACKED_PADDING + 1)) {
+    return -1;
+  }
 
+  uint32_t length = mrna->length + count;
+  uint32_t needed = length / 4 + 1 + PACKED_PADDING;
+  if (needed > mrna->capacity) {
+    uint32_t capacity = mrna->capacity < needed / 2 ? needed : 2 * mrna->capacity;
+    uint8_t *bases = realloc(mrna->bases, capacity);
+    if (bases == NULL) {
+      return -1;
+    }
+    // Bases are ORed in, padding must stay zero
+    memset(bases + mrna->capacity, 0, capacity - mrna->capacity);
+    mrna->bases = bases;
+    mrna->capacity = capacity;
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t position = mrna->length + i;
+    mrna->bases[position / 4] |= (NUCLEOTIDE_CODES[nucleotides[i]] & 3) << (2 * (position % 4));
+  }
+  mrna->length = length;
   return 0;
 }
+
+/**
+ * 64 bits of bases starting at the byte of position, base position % 4
+ * is at bit 2 * (position % 4).
+ */
+static inline uint64_t packedWord(const PackedMrna *mrna, uint32_t position) {
+  uint64_t word;
+  memcpy(&word, mrna->bases + position / 4, sizeof word);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  word = __builtin_bswap64(word);
+#endif
+  return word;
+}
+
+/**
+ * Bit 2 * i is set where base i of word has code.
+ */
+static inline uint64_t packedMatches(uint64_t word, uint64_t code) {
+  uint64_t differs = word ^ (code * 0x5555555555555555ULL);
+  return ~(differs | differs >> 1) & 0x5555555555555555ULL;
+}
+
+/**
+ * Finds the next AUG, 29 positions per step.
+ * @return Position of its A, mrna->length if there is none.
+ */
+static inline uint32_t findStartCodon(const PackedMrna *mrna, uint32_t from) {
+  // Aligned to a byte, a word covers the codons starting at 0 to 29
+  for (uint32_t position = from & ~3U; position + 2 < mrna->length; position += 28) {
+    uint64_t word = packedWord(mrna, position);
+    uint64_t starts = packedMatches(word, 0) & packedMatches(word, 3) >> 2 & packedMatches(word, 2) >> 4;
+    starts &= 0x0555555555555555ULL;
+    if (position < from) {
+      starts &= ~0ULL << 2 * (from - position);
+    }
+    if (starts != 0) {
+      uint32_t found = position + __builtin_ctzll(starts) / 2;
+      return found + 2 < mrna->length ? found : mrna->length;
+    }
+  }
+  return mrna->length;
+}
+
+/**
+ * Finds the next stop codon (UAA, UAG or UGA) in frame with position,
+ * 24 positions per step.
+ * @return Position of its U, mrna->length if there is none.
+ */
+static inline uint32_t findStopCodon(const PackedMrna *mrna, uint32_t position) {
+  // Aligned to a byte and stepping by a multiple of 3, the frame stays put
+  uint32_t aligned = position & ~3U;
+  uint64_t frame = PACKED_FRAMES[(position - aligned) % 3] & ~0ULL << 2 * (position - aligned);
+  for (uint32_t base = aligned; base + 2 < mrna->length; base += 24) {
+    uint64_t word = packedWord(mrna, base);
+    uint64_t a = packedMatches(word, 0);
+    uint64_t g = packedMatches(word, 2);
+    uint64_t stops = packedMatches(word, 3) & ((a >> 2 & (a | g) >> 4) | (g >> 2 & a >> 4)) & frame;
+    if (stops != 0) {
+      uint32_t found = base + __builtin_ctzll(stops) / 2;
+      return found + 2 < mrna->length ? found : mrna->length;
+    }
+    frame = PACKED_FRAMES[(position - aligned) % 3];
+  }
+  return mrna->length;
+}
+
+/**
+ * Finds the next AUG in frame with position, 24 positions per step.
+ * @return Position of its A, mrna->length if there is none.
+ */
+static inline uint32_t findFrameStartCodon(const PackedMrna *mrna, uint32_t position) {
+  uint32_t aligned = position & ~3U;
+  uint64_t frame = PACKED_FRAMES[(position - aligned) % 3] & ~0ULL << 2 * (position - aligned);
+  for (uint32_t base = aligned; base + 2 < mrna->length; base += 24) {
+    uint64_t word = packedWord(mrna, base);
+    uint64_t starts = packedMatches(word, 0) & packedMatches(word, 3) >> 2 & packedMatches(word, 2) >> 4 & frame;
+    if (starts != 0) {
+      uint32_t found = base + __builtin_ctzll(starts) / 2;
+      return found + 2 < mrna->length ? found : mrna->length;
+    }
+    frame = PACKED_FRAMES[(position - aligned) % 3];
+  }
+  return mrna->length;
+}
+
+/**
+ * The reverse complement of a sequence, its other strand read in the same
+ * direction. Complementing a code is inverting its bits.
+ * @param reverse Receives the new sequence, the caller frees its bases.
+ * @return 0 on success, -1 if calloc failed.
+ */
+static inline int reverseComplement(const PackedMrna *mrna, PackedMrna *reverse) {
+  uint32_t length = mrna->length;
+  uint32_t capacity = length / 4 + 1 + PACKED_PADDING;
+  uint8_t *bases = calloc(capacity, 1);
+  if (bases == NULL) {
+    return -1;
+  }
+
+  // 32 bases per step, from the end of the sequence
+  uint32_t i = 0;
+  for (; i + 32 <= length; i += 32) {
+    uint32_t from = length - 32 - i;
+    unsigned shift = 2 * (from % 4);
+    uint64_t word = packedWord(mrna, from) >> shift;
+    if (shift != 0) {
+      word |= (uint64_t) mrna->bases[from / 4 + 8] << (64 - shift);
+    }
+    // Reverse the bytes, then the bases within each byte
+    word = __builtin_bswap64(word);
+    word = (word >> 4 & 0x0F0F0F0F0F0F0F0FULL) | (word & 0x0F0F0F0F0F0F0F0FULL) << 4;
+    word = (word >> 2 & 0x3333333333333333ULL) | (word & 0x3333333333333333ULL) << 2;
+    word = ~word;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    memcpy(bases + i / 4, &word, sizeof word);
+  }
+  for (; i < length; i++) {
+    uint32_t from = length - 1 - i;
+    uint8_t code = mrna->bases[from / 4] >> 2 * (from % 4) & 3;
+    bases[i / 4] |= (code ^ 3) << 2 * (i % 4);
+  }
+
+  reverse->bases = bases;
+  reverse->length = length;
+  reverse->capacity = capacity;
+  return 0;
+}
+
+/**
+ * Amino acid of the codon at position.
+ */
+static inline uint8_t packedAminoAcid(const PackedMrna *mrna, uint32_t position) {
+  unsigned codon = (packedWord(mrna, position) >> 2 * (position % 4)) & 63;
+  // CODON_TABLE has the first base highest
+  return CODON_TABLE[(codon & 3) << 4 | (codon & 12) | codon >> 4];
+}
+
+/**
+ * Scalar translatePacked, also handles the rest of the vector version.
+ */
+static inline uint32_t translatePackedScalar(const PackedMrna *mrna, uint32_t position, uint32_t codons,
+                                             uint8_t *aminos) {
+  for (uint32_t i = 0; i < codons; i++) {
+    uint8_t amino = packedAminoAcid(mrna, position + 3 * i);
+    aminos[i] = amino;
+    if (amino == AMINO_STOP) {
+      return i;
+    }
+  }
+  return codons;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+
+/**
+ * translatePacked with SSSE3, 16 codons (12 bytes) per step.
+ *
+ * Shuffles spread the bytes to one lane per base, masking and a nibble
+ * lookup leave the code of that base. Three more shuffles per vector split
+ * the codes into first, second and third bases. The first base selects a
+ * quarter of CODON_TABLE and the other two index into it.
+ */
+__attribute__((target("ssse3")))
+static uint32_t translatePackedSsse3(const PackedMrna *mrna, uint32_t position, uint32_t codons,
+                                     uint8_t *aminos) {
+  // Blocks start on a byte, which is at most 3 codons away
+  uint32_t i = 0;
+  while (i < codons && (position + 3 * i) % 4 != 0) {
+    uint8_t amino = packedAminoAcid(mrna, position + 3 * i);
+    aminos[i] = amino;
+    if (amino == AMINO_STOP) {
+      return i;
+    }
+    i++;
+  }
+
+  const __m128i spread0 = _mm_setr_epi8(0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3);
+  const __m128i spread1 = _mm_setr_epi8(4, 4, 4, 4, 5, 5, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7);
+  const __m128i spread2 = _mm_setr_epi8(8, 8, 8, 8, 9, 9, 9, 9, 10, 10, 10, 10, 11, 11, 11, 11);
+  const __m128i lanes = _mm_setr_epi8(3, 12, 48, -64, 3, 12, 48, -64, 3, 12, 48, -64, 3, 12, 48, -64);
+  // A masked nibble is the code shifted by 0 or 2
+  const __m128i unshift = _mm_setr_epi8(0, 1, 2, 3, 1, 0, 0, 0, 2, 0, 0, 0, 3, 0, 0, 0);
+  const __m128i nibble = _mm_set1_epi8(0x0F);
+  // Lane i of a 48 lane block in the first, second and third 16 lanes
+  const __m128i splitF0 = _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i splitF1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1);
+  const __m128i splitF2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13);
+  const __m128i splitS0 = _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i splitS1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1);
+  const __m128i splitS2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14);
+  const __m128i splitT0 = _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i splitT1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1);
+  const __m128i splitT2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15);
+  const __m128i stop = _mm_set1_epi8((char) AMINO_STOP);
+  const __m128i quarter0 = _mm_loadu_si128((const __m128i *) (CODON_TABLE + 0));
+  const __m128i quarter1 = _mm_loadu_si128((const __m128i *) (CODON_TABLE + 16));
+  const __m128i quarter2 = _mm_loadu_si128((const __m128i *) (CODON_TABLE + 32));
+  const __m128i quarter3 = _mm_loadu_si128((const __m128i *) (CODON_TABLE + 48));
+
+  for (; i + 16 <= codons; i += 16) {
+    // 16 bytes fit, PACKED_PADDING covers the 4 not needed
+    __m128i packed = _mm_loadu_si128((const __m128i *) (mrna->bases + (position + 3 * i) / 4));
+    __m128i b0 = _mm_and_si128(_mm_shuffle_epi8(packed, spread0), lanes);
+    __m128i b1 = _mm_and_si128(_mm_shuffle_epi8(packed, spread1), lanes);
+    __m128i b2 = _mm_and_si128(_mm_shuffle_epi8(packed, spread2), lanes);
+    b0 = _mm_or_si128(_mm_shuffle_epi8(unshift, _mm_and_si128(b0, nibble)),
+                      _mm_shuffle_epi8(unshift, _mm_and_si128(_mm_srli_epi16(b0, 4), nibble)));
+    b1 = _mm_or_si128(_mm_shuffle_epi8(unshift, _mm_and_si128(b1, nibble)),
+                      _mm_shuffle_epi8(unshift, _mm_and_si128(_mm_srli_epi16(b1, 4), nibble)));
+    b2 = _mm_or_si128(_mm_shuffle_epi8(unshift, _mm_and_si128(b2, nibble)),
+                      _mm_shuffle_epi8(unshift, _mm_and_si128(_mm_srli_epi16(b2, 4), nibble)));
+
+    __m128i f = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(b0, splitF0), _mm_shuffle_epi8(b1, splitF1)),
+                             _mm_shuffle_epi8(b2, splitF2));
+    __m128i s = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(b0, splitS0), _mm_shuffle_epi8(b1, splitS1)),
+                             _mm_shuffle_epi8(b2, splitS2));
+    __m128i t = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(b0, splitT0), _mm_shuffle_epi8(b1, splitT1)),
+                             _mm_shuffle_epi8(b2, splitT2));
+
+    __m128i low = _mm_or_si128(_mm_slli_epi16(s, 2), t);
+    __m128i amino = _mm_shuffle_epi8(quarter0, low);
+    __m128i quarter = _mm_cmpeq_epi8(f, _mm_set1_epi8(1));
+    amino = _mm_or_si128(_mm_andnot_si128(quarter, amino), _mm_and_si128(quarter, _mm_shuffle_epi8(quarter1, low)));
+    quarter = _mm_cmpeq_epi8(f, _mm_set1_epi8(2));
+    amino = _mm_or_si128(_mm_andnot_si128(quarter, amino), _mm_and_si128(quarter, _mm_shuffle_epi8(quarter2, low)));
+    quarter = _mm_cmpeq_epi8(f, _mm_set1_epi8(3));
+    amino = _mm_or_si128(_mm_andnot_si128(quarter, amino), _mm_and_si128(quarter, _mm_shuffle_epi8(quarter3, low)));
+    _mm_storeu_si128((__m128i *) (aminos + i), amino);
+
+    int stops = _mm_movemask_epi8(_mm_cmpeq_epi8(amino, stop));
+    if (stops != 0) {
+      return i + __builtin_ctz(stops);
+    }
+  }
+  return i + translatePackedScalar(mrna, position + 3 * i, codons - i, aminos + i);
+}
+#endif
+
+/**
+ * Translates the codons of a packed sequence until the first stop codon.
+ * @param position Position of the first codon.
+ * @param codons Number of codons, all within the sequence.
+ * @param aminos Receives an amino acid per codon, room for codons bytes.
+ * @return Index of the codon translated to AMINO_STOP, codons if there is
+ *         none.
+ */
+static inline uint32_t translatePacked(const PackedMrna *mrna, uint32_t position, uint32_t codons,
+                                       uint8_t *aminos) {
+#if defined(__x86_64__) || defined(__i386__)
+  static int ssse3 = -1;
+  // Relaxed, server threads may race to store the same value
+  int supported = __atomic_load_n(&ssse3, __ATOMIC_RELAXED);
+  if (supported == -1) {
+    supported = __builtin_cpu_supports("ssse3");
+    __atomic_store_n(&ssse3, supported, __ATOMIC_RELAXED);
+  }
+  if (supported) {
+    return translatePackedSsse3(mrna, position, codons, aminos);
+  }
+#endif
+  return translatePackedScalar(mrna, position, codons, aminos);
+}
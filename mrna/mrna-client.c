@@ -34,12 +34,10 @@
 // Shared memory etc
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
-// Semaphores
-#include <semaphore.h>
-
 // Signals
 #include <signal.h>
 
@@ -50,26 +48,24 @@ static const char *programName = "mrna-client";
 /// The SharedMemory object
 static SharedMemory *sharedMemory;
 
-/// The first semaphore
-static sem_t *sem1;
-
-/// The semaphore for waiting for clients
-static sem_t *sem2;
-
-/// The semaphore for waiting for client to finish reading
-static sem_t *sem3;
+/// Our channel to the server
+static Slot *slot;
 
-/// The semaphore for clients to wait
-static sem_t *sem4;
+/// The request being written and the response being read
+static Message *request;
+static Message *response;
 
 /// Signal handling
 static volatile sig_atomic_t wantsQuit = 0;
 
 /// Current client id for server
-static uint8_t clientId = 0;
+static uint32_t clientId = HANDLE_NONE;
+
+/// Sequence number of the last request
+static uint32_t requestSequence = 0;
 
 /// Current mrna count
-static int currentMrnaCount = 0;
+static uint32_t currentMrnaCount = 0;
 
 /**
  * Prints the usage and exits.
@@ -82,9 +78,36 @@ static void usage(void);
 static void createSharedMemory(void);
 
 /**
- * Creates the needed semaphores
+ * Claims a free slot in the shared memory
+ */
+static void claimSlot(void);
+
+/**
+ * Reserves the next request in our slot and fills its header
+ * @param opcode The command.
+ */
+static void beginRequest(uint8_t opcode);
+
+/**
+ * Sends the request and waits for the response
  */
-static void createSemaphores(void);
+static void transact(void);
+
+/**
+ * Hands the read response back to the server
+ */
+static void finishResponse(void);
+
+/**
+ * Waits for the next response, for answers streamed in chunks
+ */
+static void awaitResponse(void);
+
+/**
+ * Ping command, measures the round trip latency
+ * @param rounds Number of round trips.
+ */
+static void ping(long rounds);
 
 /**
  * Submit command
@@ -96,6 +119,31 @@ static void submit(void);
  */
 static void nextSequence(void);
 
+/**
+ * Collects a response streamed in chunks
+ * @param length Receives the number of bytes.
+ * @return The whole payload, the caller frees it.
+ */
+static uint8_t *collectResponse(size_t *length);
+
+/**
+ * Prints a list of proteins, a count and the start, end, length and
+ * protein of every reading frame
+ * @param offset Where the list starts, moved behind it.
+ * @return The number of proteins.
+ */
+static uint32_t printProteins(const uint8_t *data, size_t length, size_t *offset);
+
+/**
+ * Batch command, shows all proteins at once
+ */
+static void batch(void);
+
+/**
+ * Six frame command, shows the proteins of every frame of both strands
+ */
+static void sixFrames(void);
+
 /**
  * Reset command
  */
@@ -121,7 +169,23 @@ int main(int argc, char *argv[]) {
   if (argc > 0) {
     programName = argv[0];
   }
-  if (argc > 1) {
+  long pingRounds = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "p:")) != -1) {
+    switch (opt) {
+      case 'p': {
+        char *end;
+        pingRounds = strtol(optarg, &end, 10);
+        if (*end != '\0' || pingRounds <= 0) {
+          usage();
+        }
+        break;
+      }
+      default:
+        usage();
+    }
+  }
+  if (optind != argc) {
     usage();
   }
   // Cleanup on exit
@@ -143,8 +207,13 @@ int main(int argc, char *argv[]) {
   // Create shared memory object
   createSharedMemory();
 
-  // Create semaphores
-  createSemaphores();
+  // Get our own channel
+  claimSlot();
+
+  if (pingRounds > 0) {
+    ping(pingRounds);
+    return EXIT_SUCCESS;
+  }
 
   // Test
   // printf("The number %u was read!\n", sharedMemory->data[1]);
@@ -219,6 +288,8 @@ int main(int argc, char *argv[]) {
   printf("Available commands:\n");
   printf("%s\n", "  s - submit a new mRNA sequence");
   printf("%s\n", "  n - show next protein sequence in active mRNA sequence");
+  printf("%s\n", "  b - show all protein sequences in active mRNA sequence");
+  printf("%s\n", "  f - show the protein sequences of all six reading frames");
   printf("%s\n", "  r - reset active mRNA sequence");
   printf("%s\n", "  q - close this client");
 
@@ -236,6 +307,12 @@ int main(int argc, char *argv[]) {
       case 'n':
         nextSequence();
         break;
+      case 'b':
+        batch();
+        break;
+      case 'f':
+        sixFrames();
+        break;
       case 'r':
         reset();
         break;
@@ -257,18 +334,26 @@ int main(int argc, char *argv[]) {
 }
 
 static void createSharedMemory(void) {
-  int shmfd = shm_open(SHM_NAME, O_RDWR | O_CREAT, SHM_PERMISSION);
+  // Only the server creates the segment
+  int shmfd = shm_open(SHM_NAME, O_RDWR, SHM_PERMISSION);
   if (shmfd == -1) {
-    fprintf(stderr, "Shared memory allocation failed.\n");
+    fprintf(stderr, "%s\n", errno == ENOENT ? "The server is not running." : "Shared memory allocation failed.");
+    exit(EXIT_FAILURE);
+  }
+  // A server which is just starting may not have sized it yet
+  struct stat status;
+  if (fstat(shmfd, &status) == -1 || status.st_size < (off_t) sizeof *sharedMemory) {
+    fprintf(stderr, "%s\n", "The server is not running.");
     exit(EXIT_FAILURE);
   }
 
-  sharedMemory = mmap(NULL, sizeof *sharedMemory, PROT_READ | PROT_WRITE, MAP_SHARED, shmfd, 0);
+  SharedMemory *memory = mmap(NULL, sizeof *sharedMemory, PROT_READ | PROT_WRITE, MAP_SHARED, shmfd, 0);
 
-  if (sharedMemory == MAP_FAILED) {
+  if (memory == MAP_FAILED) {
     fprintf(stderr, "mmap failed\n");
     exit(EXIT_FAILURE);
   }
+  sharedMemory = memory;
 
   if (close(shmfd) == -1) {
     fprintf(stderr, "Closing the shared memory file failed.\n");
@@ -276,47 +361,100 @@ static void createSharedMemory(void) {
   }
 }
 
-static void createSemaphores(void) {
-  sem1 = sem_open(SEM_1, 0);
-  if (sem1 == SEM_FAILED) {
-    fprintf(stderr, "sem_open failed\n");
-    exit(EXIT_FAILURE);
+static void claimSlot(void) {
+  uint32_t self = getpid();
+  for (int i = 0; i < SHM_SLOTS && slot == NULL; i++) {
+    uint32_t *state = &sharedMemory->slots[i].state;
+    uint32_t owner = __atomic_load_n(state, __ATOMIC_ACQUIRE);
+    // Take over the slot of a client which died without freeing it
+    if (owner != SLOT_FREE && (kill(owner, 0) == 0 || errno != ESRCH)) {
+      continue;
+    }
+    if (__atomic_compare_exchange_n(state, &owner, self, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+      slot = &sharedMemory->slots[i];
+    }
   }
-  sem2 = sem_open(SEM_2, 0);
-  if (sem2 == SEM_FAILED) {
-    fprintf(stderr, "sem_open failed\n");
+  if (slot == NULL) {
+    fprintf(stderr, "%s\n", "The server is busy, no free slot left.");
     exit(EXIT_FAILURE);
   }
-  sem3 = sem_open(SEM_3, 0);
-  if (sem3 == SEM_FAILED) {
-    fprintf(stderr, "sem_open failed\n");
-    exit(EXIT_FAILURE);
+
+  // Let the server drop whatever the last owner left in the rings
+  uint32_t epoch = __atomic_add_fetch(&slot->epoch, 1, __ATOMIC_SEQ_CST);
+  ringDoorbell(sharedMemory, slot);
+  uint32_t ready;
+  while ((ready = __atomic_load_n(&slot->ready, __ATOMIC_ACQUIRE)) != epoch) {
+    futexWait(&slot->ready, ready);
   }
+}
+
+static void beginRequest(uint8_t opcode) {
+  request = ringWaitReserve(&slot->requests);
+  request->header.version = PROTOCOL_VERSION;
+  request->header.opcode = opcode;
+  request->header.flags = 0;
+  request->header.clientId = clientId;
+  request->header.sequence = ++requestSequence;
+  request->header.length = 0;
+}
+
+static void transact(void) {
+  // Tell the server we are finished requesting.
+  ringPush(&slot->requests);
+  ringDoorbell(sharedMemory, slot);
 
-  sem4 = sem_open(SEM_4, 0);
-  if (sem4 == SEM_FAILED) {
-    fprintf(stderr, "sem_open failed\n");
+  // Wait until we can read the response.
+  awaitResponse();
+}
+
+static void awaitResponse(void) {
+  response = ringWaitPeek(&slot->responses);
+  if (response->header.version != PROTOCOL_VERSION || response->header.sequence != requestSequence
+      || response->header.length > SHM_MAX_PAYLOAD) {
+    fprintf(stderr, "%s\n", "The server seems malicious.");
     exit(EXIT_FAILURE);
   }
 }
 
-static void cleanup(void) {
-  // printf("Cleaning up\n");
-  // Cleanup
-  if (munmap(sharedMemory, sizeof *sharedMemory) == -1) {
-    fprintf(stderr, "munmap failed\n");
+static void finishResponse(void) {
+  ringPop(&slot->responses);
+  // The server skips our requests while our responses are full
+  ringDoorbell(sharedMemory, slot);
+}
+
+static void ping(long rounds) {
+  struct timespec start, end;
+  if (clock_gettime(CLOCK_MONOTONIC, &start) == -1) {
+    fprintf(stderr, "clock_gettime failed\n");
+    exit(EXIT_FAILURE);
   }
-  if (sem_close(sem1) == -1) {
-    fprintf(stderr, "sem_unlink failed\n");
+  for (long i = 0; i < rounds; i++) {
+    beginRequest('p');
+
+    transact();
+
+    if (response->header.opcode != SHM_SUCCESS_BYTE) {
+      fprintf(stderr, "%s\n", "Something went wrong while requesting from the server.");
+      exit(EXIT_FAILURE);
+    }
+    finishResponse();
   }
-  if (sem_close(sem2) == -1) {
-    fprintf(stderr, "sem_unlink failed\n");
+  if (clock_gettime(CLOCK_MONOTONIC, &end) == -1) {
+    fprintf(stderr, "clock_gettime failed\n");
+    exit(EXIT_FAILURE);
   }
-  if (sem_close(sem3) == -1) {
-    fprintf(stderr, "sem_unlink failed\n");
+
+  double nanos = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+  printf("%ld round trips, %.0f ns per round trip\n", rounds, nanos / rounds);
+}
+
+static void cleanup(void) {
+  // Give our slot to the next client
+  if (slot != NULL) {
+    __atomic_store_n(&slot->state, SLOT_FREE, __ATOMIC_RELEASE);
   }
-  if (sem_close(sem4) == -1) {
-    fprintf(stderr, "sem_unlink failed\n");
+  if (sharedMemory != NULL && munmap(sharedMemory, sizeof *sharedMemory) == -1) {
+    fprintf(stderr, "munmap failed\n");
   }
 }
 
@@ -326,13 +464,17 @@ static void submit(void) {
 
   int running = 1;
 
-  int mrnaCount = 0;
-  char *mrna;
+  uint32_t mrnaCount = 0;
+  uint32_t capacity = 0;
+  uint8_t *mrna = NULL;
 
   int newLineCount = 0;
 
   while (running) {
-    char c = getchar();
+    int c = getchar();
+    if (c == EOF) {
+      break;
+    }
     if (c == '\n') {
       newLineCount++;
       if (newLineCount >= 2) {
@@ -344,216 +486,227 @@ static void submit(void) {
     }
 
     if (c == 'U' || c == 'C' || c == 'A' || c == 'G') {
-      mrnaCount++;
-      if (mrnaCount == 0) {
-        mrna = malloc(sizeof(char));
-      } else {
-        mrna = realloc(mrna, sizeof(char) * mrnaCount);
+      if (mrnaCount == capacity) {
+        capacity = capacity == 0 ? 4096 : 2 * capacity;
+        mrna = realloc(mrna, capacity);
+        if (mrna == NULL) {
+          fprintf(stderr, "%s\n", "realloc failed");
+          exit(EXIT_FAILURE);
+        }
       }
-      mrna[mrnaCount - 1] = c;
+      mrna[mrnaCount++] = c;
     }
 
     // We collect only valid characters.
     // After two newlines we set running to 0.
   }
-
-  // Hard check for now
-  if (mrnaCount >= 250) {
-    printf("%s\n", "Please don't type in more that 249 characters.");
-    return;
-  }
   currentMrnaCount = mrnaCount;
 
-  // Submit mrna to server
-
-  if (sem_wait(sem1) != 0) {
-    fprintf(stderr, "sem_wait failed\n");
-    exit(EXIT_FAILURE);
-  }
-  sharedMemory->data[0] = 's';
-  for (int i = 0; i < mrnaCount; i++) {
-    sharedMemory->data[i + 1] = mrna[i];
-  }
-  sharedMemory->data[mrnaCount] = SHM_END_BYTE;
-
-  // Nice, We are finished requesting. Ask server to answer.
-  if (sem_post(sem2) != 0) {
-    fprintf(stderr, "sem_wait failed\n");
-    exit(EXIT_FAILURE);
-  }
-
-  // Wait for server response.
-  if (sem_wait(sem4) != 0) {
-    fprintf(stderr, "sem_wait failed\n");
-    exit(EXIT_FAILURE);
-  }
-
-  // Read
-  // printf("%u\n", sharedMemory->data[0]);
-  // printf("%u\n", sharedMemory->data[1]);
-
-  int resp = sharedMemory->data[0];
-
-  // VERY IMPORTANT FOR ALL FOLLOWING REQUESTS
-  clientId = sharedMemory->data[1];
+  // The server keeps one sequence per client
+  quit();
+
+  // Submit mrna to server. The first chunk starts the sequence and gets
+  // us the client id, the rest are appended to it.
+  uint32_t sent = 0;
+  do {
+    beginRequest(sent == 0 ? 's' : 'a');
+    uint32_t chunk = mrnaCount - sent;
+    if (chunk > SHM_MAX_PAYLOAD) {
+      chunk = SHM_MAX_PAYLOAD;
+    }
+    memcpy(request->payload, mrna + sent, chunk);
+    request->header.length = chunk;
+    // The server looks the sequence up once the last chunk is in
+    if (sent + chunk < mrnaCount) {
+      request->header.flags = MESSAGE_MORE;
+    }
 
-  // Tell server we are finished reading.
-  if (sem_post(sem3) != 0) {
-    fprintf(stderr, "sem_wait failed\n");
-    exit(EXIT_FAILURE);
-  }
+    // Nice, We are finished requesting. Ask server to answer.
+    transact();
 
-  if (resp == SHM_ERROR_BYTE) {
-    fprintf(stderr, "%s\n", "Something went wrong while requesting from the server.");
-    exit(EXIT_FAILURE);
-  }
+    int resp = response->header.opcode;
+    if (resp == SHM_ERROR_BYTE) {
+      fprintf(stderr, "%s\n", "Something went wrong while requesting from the server.");
+      exit(EXIT_FAILURE);
+    }
+    if (sent == 0) {
+      // VERY IMPORTANT FOR ALL FOLLOWING REQUESTS
+      clientId = response->header.clientId;
+    }
+    finishResponse();
+    sent += chunk;
+  } while (sent < mrnaCount);
+  free(mrna);
 }
 
 static void nextSequence(void) {
-  // Wait until we can start the request.
-  if (sem_wait(sem1) != 0) {
-    fprintf(stderr, "sem_wait failed\n");
-    exit(EXIT_FAILURE);
-  }
-  sharedMemory->data[0] = 'n';
-  sharedMemory->data[1] = clientId;
-  sharedMemory->data[2] = SHM_END_BYTE;
-
-  // Tell the server we are finished requesting.
-  if (sem_post(sem2) != 0) {
-    fprintf(stderr, "sem_wait failed\n");
-    exit(EXIT_FAILURE);
-  }
+  beginRequest('n');
 
-  // Wait until we can read the response.
-  if (sem_wait(sem4) != 0) {
-    fprintf(stderr, "sem_wait failed\n");
-    exit(EXIT_FAILURE);
-  }
+  transact();
 
-  int resp = sharedMemory->data[0];
+  int resp = response->header.opcode;
   if (resp == SHM_ERROR_BYTE) {
-    // We need to tell the server that we are finished reading
-    // or other clients will be stuck.
-    sem_post(sem3);
     fprintf(stderr, "%s\n", "Something went wrong while requesting from the server.");
     exit(EXIT_FAILURE);
   }
 
   if (resp == SHM_END_REACHED_BYTE) {
-    printf("End reached [%i/%i], send r to reset.\n", currentMrnaCount, currentMrnaCount);
+    printf("End reached [%u/%u], send r to reset.\n", currentMrnaCount, currentMrnaCount);
   } else {
-    uint8_t start = sharedMemory->data[1];
-    uint8_t end = sharedMemory->data[2];
-    printf("Protein sequence found [%i/%i] to [%i/%i]: ", start, currentMrnaCount, end, currentMrnaCount);
+    uint32_t start;
+    uint32_t end;
+    if (response->header.length < sizeof start + sizeof end) {
+      fprintf(stderr, "%s\n", "The server seems malicious.");
+      exit(EXIT_FAILURE);
+    }
+    memcpy(&start, response->payload, sizeof start);
+    memcpy(&end, response->payload + 4, sizeof end);
+    printf("Protein sequence found [%u/%u] to [%u/%u]: ", start, currentMrnaCount, end, currentMrnaCount);
 
-    int i = 3;
+    // Long proteins arrive in several responses
+    uint32_t offset = sizeof start + sizeof end;
     while (true) {
-      if (i >= SHM_MAX_DATA) {
-        fprintf(stderr, "%s\n", "The server seems malicious.");
-        exit(EXIT_FAILURE);
-      }
-      uint8_t d = sharedMemory->data[i];
-      if (d == SHM_END_BYTE) {
+      fwrite(response->payload + offset, 1, response->header.length - offset, stdout);
+      if (!(response->header.flags & MESSAGE_MORE)) {
         break;
       }
-      printf("%c", d);
-      i++;
+      finishResponse();
+      awaitResponse();
+      if (response->header.opcode == SHM_ERROR_BYTE) {
+        fprintf(stderr, "%s\n", "Something went wrong while requesting from the server.");
+        exit(EXIT_FAILURE);
+      }
+      offset = 0;
     }
     printf("\n");
   }
+  finishResponse();
+}
 
-  // printf("%u\n", sharedMemory->data[0]);
-  // printf("%u\n", sharedMemory->data[1]);
-  // printf("%u\n", sharedMemory->data[2]);
-
-  // We are done reading. Tell the server about it.
-  if (sem_post(sem3) != 0) {
-    fprintf(stderr, "sem_wait failed\n");
-    exit(EXIT_FAILURE);
+static uint8_t *collectResponse(size_t *length) {
+  // Records may span responses
+  uint8_t *data = NULL;
+  *length = 0;
+  while (true) {
+    if (response->header.opcode == SHM_ERROR_BYTE) {
+      fprintf(stderr, "%s\n", "Something went wrong while requesting from the server.");
+      exit(EXIT_FAILURE);
+    }
+    data = realloc(data, *length + response->header.length);
+    if (data == NULL && *length + response->header.length > 0) {
+      fprintf(stderr, "%s\n", "realloc failed");
+      exit(EXIT_FAILURE);
+    }
+    memcpy(data + *length, response->payload, response->header.length);
+    *length += response->header.length;
+    if (!(response->header.flags & MESSAGE_MORE)) {
+      break;
+    }
+    finishResponse();
+    awaitResponse();
   }
+  finishResponse();
+  return data;
 }
 
-static void reset(void) {
-  // Wait until we can start the request.
-  if (sem_wait(sem1) != 0) {
-    fprintf(stderr, "sem_wait failed\n");
+static uint32_t printProteins(const uint8_t *data, size_t length, size_t *offset) {
+  uint32_t count;
+  if (length - *offset < sizeof count) {
+    fprintf(stderr, "%s\n", "The server seems malicious.");
     exit(EXIT_FAILURE);
   }
-  sharedMemory->data[0] = 'r';
-  sharedMemory->data[1] = clientId;
-  sharedMemory->data[2] = SHM_END_BYTE;
-
-  // Tell the server we are finished requesting.
-  if (sem_post(sem2) != 0) {
-    fprintf(stderr, "sem_wait failed\n");
-    exit(EXIT_FAILURE);
+  memcpy(&count, data + *offset, sizeof count);
+  *offset += sizeof count;
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t start;
+    uint32_t end;
+    uint32_t proteinLength;
+    if (length - *offset < 12) {
+      fprintf(stderr, "%s\n", "The server seems malicious.");
+      exit(EXIT_FAILURE);
+    }
+    memcpy(&start, data + *offset, 4);
+    memcpy(&end, data + *offset + 4, 4);
+    memcpy(&proteinLength, data + *offset + 8, 4);
+    *offset += 12;
+    if (length - *offset < proteinLength) {
+      fprintf(stderr, "%s\n", "The server seems malicious.");
+      exit(EXIT_FAILURE);
+    }
+    printf("Protein sequence found [%u/%u] to [%u/%u]: ", start, currentMrnaCount, end, currentMrnaCount);
+    fwrite(data + *offset, 1, proteinLength, stdout);
+    printf("\n");
+    *offset += proteinLength;
   }
+  return count;
+}
 
-  // Wait until we can read the response.
-  if (sem_wait(sem4) != 0) {
-    fprintf(stderr, "sem_wait failed\n");
-    exit(EXIT_FAILURE);
+static void batch(void) {
+  beginRequest('b');
+
+  transact();
+
+  size_t length;
+  uint8_t *data = collectResponse(&length);
+  size_t offset = 0;
+  uint32_t count = printProteins(data, length, &offset);
+  printf("%u protein sequences found.\n", count);
+  free(data);
+}
+
+static void sixFrames(void) {
+  beginRequest('f');
+
+  transact();
+
+  size_t length;
+  uint8_t *data = collectResponse(&length);
+  size_t offset = 0;
+  // Positions of the reverse frames count on the reverse complement
+  for (int frame = 0; frame < 6; frame++) {
+    printf("Frame %c%d:\n", frame < 3 ? '+' : '-', frame % 3 + 1);
+    uint32_t count = printProteins(data, length, &offset);
+    printf("%u protein sequences found.\n", count);
   }
+  free(data);
+}
+
+static void reset(void) {
+  beginRequest('r');
 
-  int resp = sharedMemory->data[0];
+  transact();
+
+  int resp = response->header.opcode;
   if (resp == SHM_ERROR_BYTE) {
-    // We need to tell the server that we are finished reading
-    // or other clients will be stuck.
-    sem_post(sem3);
     fprintf(stderr, "%s\n", "Something went wrong while requesting from the server.");
     exit(EXIT_FAILURE);
   }
 
-  printf("Reset. [0/%i]\n", currentMrnaCount);
+  finishResponse();
 
-  // We are done reading. Tell the server about it.
-  if (sem_post(sem3) != 0) {
-    fprintf(stderr, "sem_wait failed\n");
-    exit(EXIT_FAILURE);
-  }
+  printf("Reset. [0/%u]\n", currentMrnaCount);
 }
 
 static void quit(void) {
-  // Wait until we can start the request.
-  if (sem_wait(sem1) != 0) {
-    fprintf(stderr, "sem_wait failed\n");
-    exit(EXIT_FAILURE);
-  }
-  sharedMemory->data[0] = 'q';
-  sharedMemory->data[1] = clientId;
-  sharedMemory->data[2] = SHM_END_BYTE;
-
-  // Tell the server we are finished requesting.
-  if (sem_post(sem2) != 0) {
-    fprintf(stderr, "sem_wait failed\n");
-    exit(EXIT_FAILURE);
+  if (clientId == HANDLE_NONE) {
+    // Nothing submitted yet
+    return;
   }
+  beginRequest('q');
 
-  // Wait until we can read the response.
-  if (sem_wait(sem4) != 0) {
-    fprintf(stderr, "sem_wait failed\n");
-    exit(EXIT_FAILURE);
-  }
+  transact();
 
-  int resp = sharedMemory->data[0];
+  int resp = response->header.opcode;
   if (resp == SHM_ERROR_BYTE) {
-    // We need to tell the server that we are finished reading
-    // or other clients will be stuck.
-    sem_post(sem3);
     fprintf(stderr, "%s\n", "Something went wrong while requesting from the server.");
     exit(EXIT_FAILURE);
   }
-
-  // We are done reading. Tell the server about it.
-  if (sem_post(sem3) != 0) {
-    fprintf(stderr, "sem_wait failed\n");
-    exit(EXIT_FAILURE);
-  }
+  finishResponse();
+  clientId = HANDLE_NONE;
 }
 
 static void usage(void) {
-  fprintf(stderr, "Usage: %s\n", programName);
+  fprintf(stderr, "Usage: %s [-p rounds]\n", programName);
   exit(EXIT_FAILURE);
 }
 
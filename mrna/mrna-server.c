@@ -37,12 +37,12 @@
 #include <sys/types.h>
 #include <unistd.h>
 
-// Semaphores
-#include <semaphore.h>
-
 // Signals
 #include <signal.h>
 
+// Workers
+#include <pthread.h>
+
 
 /// Name of this program
 static const char *programName = "mrna-server";
@@ -50,25 +50,129 @@ static const char *programName = "mrna-server";
 /// The SharedMemory object
 static SharedMemory *sharedMemory;
 
-/// The first semaphore
-static sem_t *sem1;
+/// Signal handling
+static volatile sig_atomic_t wantsQuit = 0;
 
-/// The semaphore for waiting for clients
-static sem_t *sem2;
+/// Number of server threads, thread w serves the slots w, w + workerCount, ...
+static uint32_t workerCount;
 
-/// The semaphore for waiting for client to finish reading
-static sem_t *sem3;
+/// Set once the workers should return
+static uint32_t stopping = 0;
 
-/// The semaphore for clients to wait
-static sem_t *sem4;
+/**
+ * An open reading frame, from behind its AUG to its stop codon.
+ */
+typedef struct {
+  uint32_t start;
+  uint32_t end;
+  // 'M' and the amino acids, translated on the first request
+  uint8_t *protein;
+} Orf;
 
-/// Signal handling
-static volatile sig_atomic_t wantsQuit = 0;
+/**
+ * The reading frames a client walks through with next, in order. Each one
+ * starts at the first AUG behind the stop codon of the one before. Built
+ * in one scan when the sequence is sealed.
+ */
+typedef struct {
+  Orf *orfs;
+  uint32_t count;
+  uint32_t capacity;
+} OrfIndex;
 
-/// All connected mrnas from clients and the count
-static uint8_t mrnaCount = 0;
-static uint8_t **mrnas;
-static int *mrnaPointers;
+/**
+ * A submitted sequence with its reading frames. Once its last chunk is in
+ * it is sealed and put into the cache, clients submitting the same bases
+ * share it from then on. A sealed sequence only changes by translating
+ * proteins.
+ */
+typedef struct Sequence {
+  PackedMrna mrna;
+  // Built when the sequence is sealed
+  OrfIndex index;
+  bool sealed;
+  uint64_t hash;
+  // Entries using the sequence, guarded by cacheLock once sealed
+  uint32_t references;
+  // Next sequence with the same bucket
+  struct Sequence *next;
+  // Held while a protein is translated
+  pthread_mutex_t lock;
+} Sequence;
+
+/// Sealed sequences by hash, chained, a power of two buckets
+static Sequence **cache = NULL;
+static uint32_t cacheBuckets = 0;
+static uint32_t cacheCount = 0;
+/// Guards the cache and the references of sealed sequences
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * The sequence of a client and its position. A handle is the index of its
+ * entry plus the generation shifted by HANDLE_INDEX_BITS, the generation
+ * changes whenever the entry is freed so old handles stop matching.
+ */
+typedef struct {
+  // NULL while the entry is free
+  Sequence *sequence;
+  // The reading frame next returns
+  uint32_t nextOrf;
+  // 1 to HANDLE_GENERATIONS - 1, so no handle is HANDLE_NONE
+  uint32_t generation;
+  // Next free entry while on the free list
+  uint32_t nextFree;
+  // Position in the registry
+  uint32_t position;
+  // Held while a worker uses the entry
+  pthread_mutex_t lock;
+} Entry;
+
+/// Entries per registry page, a power of two
+#define REGISTRY_PAGE (1024)
+
+/// All connected mrnas from clients, freed entries are reused first. Pages
+/// never move, so an entry stays put while the registry grows.
+static Entry *registry[HANDLE_INDEX_MASK / REGISTRY_PAGE + 1];
+static uint32_t registrySize = 0;
+static uint32_t freeEntries = HANDLE_INDEX_MASK;
+/// Guards registry, registrySize, freeEntries and the nextFree links
+static pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * A response longer than one message, sent in chunks.
+ */
+typedef struct {
+  // Header of the chunks, the flags and length vary
+  MessageHeader header;
+  uint8_t *data;
+  uint32_t length;
+  uint32_t sent;
+  uint32_t capacity;
+} Stream;
+
+/// The response each slot is streaming, only used by the worker of the slot
+static Stream streams[SHM_SLOTS];
+
+/// The handle each slot submitted last, released when the slot changes its
+/// owner, only used by the worker of the slot
+static uint32_t handles[SHM_SLOTS];
+
+/// Bases from which the six frames get a thread each, shorter ones are
+/// scanned one after the other
+#define PARALLEL_FRAMES_MIN (1 << 16)
+
+/**
+ * The reading frames of one of the six frames of a sequence
+ */
+typedef struct {
+  // The sequence or its reverse complement
+  const PackedMrna *mrna;
+  // Position of the first codon, 0 to 2
+  uint32_t frame;
+  // The count, then start, end, length and protein of every reading frame
+  Stream records;
+  bool failed;
+} FrameScan;
 
 /**
  * Prints the usage and exits.
@@ -81,9 +185,158 @@ static void usage(void);
 static void createSharedMemory(void);
 
 /**
- * Creates the needed semaphores
+ * Starts the workers, waits for a signal and stops them again
+ */
+static void runWorkers(void);
+
+/**
+ * Thread serving the slots of one worker until the server stops
+ * @param argument The number of the worker.
+ */
+static void *serveWorker(void *argument);
+
+/**
+ * Serves the next request of every slot of a worker which has one.
+ * @return Whether a request was served.
+ */
+static bool serveSlots(uint32_t worker);
+
+/**
+ * Drops what the last owner of a slot left behind: its queued requests,
+ * unread responses, streamed response and sequence. Then lets the new
+ * owner start.
+ * @param epoch The epoch of the new owner.
+ */
+static void resetSlot(uint32_t index, uint32_t epoch);
+
+/**
+ * Waits until a client rings the doorbell or the server stops.
+ * @param bell The doorbell value seen before the last scan.
+ */
+static void waitForRequests(Doorbell *doorbell, uint32_t bell);
+
+/**
+ * Handles one request and writes its response
+ * @param request The header of the request, a private copy.
+ * @param payload The payload of the request, in the ring.
+ * @param stream Receives responses which do not fit into one message.
+ */
+static void handleRequest(const MessageHeader *request, const uint8_t *payload, Message *response, Stream *stream);
+
+/**
+ * Fills the header of the response to a request
+ */
+static void respond(const MessageHeader *request, Message *response, uint8_t status, uint32_t length);
+
+/**
+ * Writes the next chunk of a stream as a response
+ */
+static void streamChunk(Stream *stream, Message *response);
+
+/**
+ * Makes room for capacity bytes in a stream
+ * @return 0 on success, -1 if realloc failed.
+ */
+static int streamReserve(Stream *stream, uint32_t capacity);
+
+/**
+ * An entry of the registry
+ * @return The entry, NULL if index is beyond the registry.
+ */
+static Entry *entryAt(uint32_t index);
+
+/**
+ * Looks a handle up
+ * @return Its entry, locked, NULL if the handle is not valid.
+ */
+static Entry *lockEntry(uint32_t handle);
+
+/**
+ * Checks the client id of a request
+ * @return The entry of the client, locked, NULL if its handle is not valid.
+ */
+static Entry *findEntry(const MessageHeader *request);
+
+/**
+ * Checks the client id of a request which needs the whole sequence
+ * @return The entry of the client, locked, NULL if its handle is not valid
+ *         or the sequence is still being submitted.
+ */
+static Entry *findSealedEntry(const MessageHeader *request);
+
+/**
+ * Stores a sequence in a free entry
+ * @param handle Receives the handle of the entry.
+ * @return The entry, locked, NULL if the registry is full.
+ */
+static Entry *registerMrna(Sequence *sequence, uint32_t *handle);
+
+/**
+ * Drops the sequence of a locked entry and puts the entry on the free list
+ */
+static void releaseEntry(Entry *entry);
+
+/**
+ * A new sequence which is still being submitted
+ * @return The sequence, NULL if malloc failed.
+ */
+static Sequence *newSequence(PackedMrna mrna);
+
+/**
+ * Seals a submitted sequence. If the cache has the same bases already the
+ * sequence is freed and the cached one is shared, otherwise its reading
+ * frames are indexed and it is cached.
+ * @return The sequence to use, NULL if indexing or caching failed, the
+ *         sequence is not sealed and has no reading frames then.
+ */
+static Sequence *sealSequence(Sequence *sequence);
+
+/**
+ * Drops the reading frames of a sequence which could not be sealed
+ */
+static void dropOrfIndex(OrfIndex *index);
+
+/**
+ * Takes a sealed sequence with the same bases out of the cache, called with
+ * cacheLock held
+ * @return The cached sequence with one more reference, NULL if there is none.
+ */
+static Sequence *cacheFind(const Sequence *sequence);
+
+/**
+ * Puts a sealed sequence into the cache, called with cacheLock held
+ * @return 0 on success, -1 if the first table could not be allocated.
+ */
+static int cacheInsert(Sequence *sequence);
+
+/**
+ * Drops a reference to a sequence, the last one frees it
+ */
+static void releaseSequence(Sequence *sequence);
+
+/**
+ * Frees a sequence with its proteins
+ */
+static void freeSequence(Sequence *sequence);
+
+/**
+ * Hashes the bases of a sequence
+ */
+static uint64_t hashMrna(const PackedMrna *mrna);
+
+/**
+ * Finds the reading frames of a complete sequence
+ * @return 0 on success, -1 if realloc failed.
  */
-static void createSemaphores(void);
+static int buildOrfIndex(const PackedMrna *mrna, OrfIndex *index);
+
+/**
+ * The protein of a reading frame of a sealed sequence, translated and kept
+ * on first use
+ * @return The protein, (orf->end - orf->start) / 3 + 1 bytes, NULL if
+ *         malloc failed.
+ */
+static const uint8_t *orfProtein(Sequence *sequence, Orf *orf);
 
 /**
  * Cleanup resources
@@ -91,29 +344,48 @@ static void createSemaphores(void);
 static void cleanup(void);
 
 /**
- * Submit command
+ * Submit command, starts a sequence with its first chunk
+ * @param payload The bases, request->length of them.
+ */
+static void submit(const MessageHeader *request, const uint8_t *payload, Message *response);
+
+/**
+ * Append command, adds the next chunk to a submitted sequence
+ * @param payload The bases, request->length of them.
  */
-static void submit(void);
+static void append(const MessageHeader *request, const uint8_t *payload, Message *response);
 
 /**
  * Next sequence command
  */
-static void nextSequence(void);
+static void nextSequence(const MessageHeader *request, Message *response, Stream *stream);
 
 /**
- * Reset command
+ * Batch command, every protein of the sequence in one streamed response
  */
-static void reset(void);
+static void batch(const MessageHeader *request, Message *response, Stream *stream);
 
 /**
- * Quit command
+ * Six frame command, the proteins of the three frames of the sequence and
+ * the three of its reverse complement, each frame scanned on its own thread
+ */
+static void sixFrames(const MessageHeader *request, Message *response, Stream *stream);
+
+/**
+ * Thread finding and translating the reading frames of one frame
+ * @param argument The FrameScan.
+ */
+static void *scanFrame(void *argument);
+
+/**
+ * Reset command
  */
-static void quit(void);
+static void reset(const MessageHeader *request, Message *response);
 
 /**
- * Reset shared memory data
+ * Quit command
  */
-static void resetSharedMemory(void);
+static void quit(const MessageHeader *request, Message *response);
 
 /**
  * Catch signals
@@ -125,21 +397,42 @@ int main(int argc, char *argv[]) {
   if (argc > 0) {
     programName = argv[0];
   }
-  if (argc > 1) {
+  long workers = sysconf(_SC_NPROCESSORS_ONLN);
+  int opt;
+  while ((opt = getopt(argc, argv, "w:")) != -1) {
+    switch (opt) {
+      case 'w': {
+        char *end;
+        workers = strtol(optarg, &end, 10);
+        if (*end != '\0' || workers <= 0 || workers > MAX_WORKERS) {
+          usage();
+        }
+        break;
+      }
+      default:
+        usage();
+    }
+  }
+  if (optind != argc) {
     usage();
   }
+  // More workers than slots would have nothing to do
+  workerCount = workers < 1 ? 1 : workers > MAX_WORKERS ? MAX_WORKERS : workers;
   // Cleanup on exit
   if (atexit(cleanup) != 0) {
     fprintf(stderr, "Could not set atexit cleanup function.\n");
     exit(EXIT_FAILURE);
   }
 
-  // Signal handlers
-  if (signal(SIGINT, catchSignals) == SIG_ERR) {
+  // Signal handlers, only the main thread takes the signals
+  struct sigaction action;
+  memset(&action, 0, sizeof action);
+  action.sa_handler = catchSignals;
+  if (sigaction(SIGINT, &action, NULL) == -1) {
     fprintf(stderr, "Signal handling impossible.\n");
     exit(EXIT_FAILURE);
   }
-  if (signal(SIGTERM, catchSignals) == SIG_ERR) {
+  if (sigaction(SIGTERM, &action, NULL) == -1) {
     fprintf(stderr, "Signal handling impossible.\n");
     exit(EXIT_FAILURE);
   }
@@ -147,9 +440,6 @@ int main(int argc, char *argv[]) {
   // Create shared memory object
   createSharedMemory();
 
-  // Create semaphores
-  createSemaphores();
-
   // Test
   /*
   sharedMemory->data[1] = 0xA;
@@ -162,88 +452,531 @@ int main(int argc, char *argv[]) {
     }
   }*/
 
-  // Wait for the first client with sem2
+  runWorkers();
+
+  return EXIT_SUCCESS;
+}
+
+static void runWorkers(void) {
+  // The workers inherit the blocked signals, so they reach the main thread
+  // in sigsuspend below.
+  sigset_t blocked, unblocked;
+  sigemptyset(&blocked);
+  sigaddset(&blocked, SIGINT);
+  sigaddset(&blocked, SIGTERM);
+  if (pthread_sigmask(SIG_BLOCK, &blocked, &unblocked) != 0) {
+    fprintf(stderr, "Signal handling impossible.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  pthread_t threads[MAX_WORKERS];
+  for (uint32_t w = 0; w < workerCount; w++) {
+    if (pthread_create(&threads[w], NULL, serveWorker, (void *) (uintptr_t) w) != 0) {
+      fprintf(stderr, "Starting the workers failed.\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
   while (!wantsQuit) {
-    // Wait until a client wants to send a request.
-    // printf("Waiting for 2...\n");
-    if (sem_wait(sem2) != 0) {
-      // Let signal handler and atexit handle this
-      if (errno == EINTR) {
-        continue;
+    sigsuspend(&unblocked);
+  }
+
+  // Wake every worker, a worker reads its doorbell before checking stopping
+  __atomic_store_n(&stopping, 1, __ATOMIC_SEQ_CST);
+  for (uint32_t w = 0; w < workerCount; w++) {
+    __atomic_add_fetch(&sharedMemory->doorbells[w].value, 1, __ATOMIC_SEQ_CST);
+    futexWake(&sharedMemory->doorbells[w].value);
+  }
+  for (uint32_t w = 0; w < workerCount; w++) {
+    pthread_join(threads[w], NULL);
+  }
+}
+
+static void *serveWorker(void *argument) {
+  uint32_t worker = (uintptr_t) argument;
+  Doorbell *doorbell = &sharedMemory->doorbells[worker];
+  int spins = 0;
+  while (true) {
+    // Read the doorbell before scanning, a request pushed after the scan
+    // changes it and keeps us from sleeping.
+    uint32_t bell = __atomic_load_n(&doorbell->value, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&stopping, __ATOMIC_SEQ_CST)) {
+      return NULL;
+    }
+    if (serveSlots(worker)) {
+      spins = 0;
+      continue;
+    }
+    if (spin(&spins)) {
+      continue;
+    }
+    waitForRequests(doorbell, bell);
+    spins = 0;
+  }
+}
+
+static bool serveSlots(uint32_t worker) {
+  bool served = false;
+  for (uint32_t i = worker; i < SHM_SLOTS; i += workerCount) {
+    Slot *slot = &sharedMemory->slots[i];
+    Stream *stream = &streams[i];
+    // A new client took the slot over
+    uint32_t epoch = __atomic_load_n(&slot->epoch, __ATOMIC_ACQUIRE);
+    if (epoch != slot->ready) {
+      resetSlot(i, epoch);
+      served = true;
+      continue;
+    }
+    // Finish a streamed response before the next request
+    if (stream->sent < stream->length) {
+      Message *response = ringReserve(&slot->responses);
+      if (response != NULL) {
+        streamChunk(stream, response);
+        ringPush(&slot->responses);
+        served = true;
       }
-      fprintf(stderr, "sem_wait failed\n");
-      exit(EXIT_FAILURE);
+      continue;
     }
 
-    // Process the request. Read from shared memory.
-    uint8_t command = sharedMemory->data[0];
-    switch (command) {
-      case 's':
-        submit();
-        break;
-      case 'n':
-        nextSequence();
-        // printf("Sequenzo n\n");
-        break;
-      case 'r':
-        reset();
-        break;
-      case 'q':
-        quit();
-        break;
-      default:
-        break;
+    Message *request = ringPeek(&slot->requests);
+    if (request == NULL) {
+      continue;
+    }
+    // Leave the request queued while the client does not read its
+    // responses, nobody else waits for it.
+    Message *response = ringReserve(&slot->responses);
+    if (response == NULL) {
+      continue;
+    }
+    // The client can still write to the ring, check and use one copy
+    MessageHeader header = request->header;
+    handleRequest(&header, request->payload, response, stream);
+    // Remember the sequence of the owner, a reset releases it
+    if (response->header.opcode == SHM_SUCCESS_BYTE) {
+      if (header.opcode == 's') {
+        handles[i] = response->header.clientId;
+      } else if (header.opcode == 'q') {
+        handles[i] = HANDLE_NONE;
+      }
+    }
+    ringPop(&slot->requests);
+    ringPush(&slot->responses);
+    served = true;
+  }
+  return served;
+}
+
+static void resetSlot(uint32_t index, uint32_t epoch) {
+  Slot *slot = &sharedMemory->slots[index];
+  streams[index].length = 0;
+  streams[index].sent = 0;
+  if (handles[index] != HANDLE_NONE) {
+    Entry *entry = lockEntry(handles[index]);
+    if (entry != NULL) {
+      releaseEntry(entry);
+      pthread_mutex_unlock(&entry->lock);
     }
+    handles[index] = HANDLE_NONE;
+  }
 
-    // printf("Posting 4\n");
+  // The new owner waits for ready and touches neither ring meanwhile
+  __atomic_store_n(&slot->requests.tail, __atomic_load_n(&slot->requests.head, __ATOMIC_ACQUIRE),
+                   __ATOMIC_SEQ_CST);
+  __atomic_store_n(&slot->responses.head, __atomic_load_n(&slot->responses.tail, __ATOMIC_ACQUIRE),
+                   __ATOMIC_SEQ_CST);
+  __atomic_store_n(&slot->ready, epoch, __ATOMIC_SEQ_CST);
+  futexWake(&slot->ready);
+}
 
-    // Tell client to start reading
-    if (sem_post(sem4) != 0) {
-      fprintf(stderr, "sem_wait failed\n");
-      exit(EXIT_FAILURE);
+static void waitForRequests(Doorbell *doorbell, uint32_t bell) {
+  __atomic_store_n(&doorbell->sleeping, 1, __ATOMIC_SEQ_CST);
+  futexWait(&doorbell->value, bell);
+  __atomic_store_n(&doorbell->sleeping, 0, __ATOMIC_SEQ_CST);
+}
+
+static void handleRequest(const MessageHeader *request, const uint8_t *payload, Message *response, Stream *stream) {
+  if (request->version != PROTOCOL_VERSION || request->length > SHM_MAX_PAYLOAD) {
+    respond(request, response, SHM_ERROR_BYTE, 0);
+    return;
+  }
+
+  // Process the request.
+  switch (request->opcode) {
+    case 's':
+      submit(request, payload, response);
+      break;
+    case 'a':
+      append(request, payload, response);
+      break;
+    case 'n':
+      nextSequence(request, response, stream);
+      break;
+    case 'b':
+      batch(request, response, stream);
+      break;
+    case 'f':
+      sixFrames(request, response, stream);
+      break;
+    case 'r':
+      reset(request, response);
+      break;
+    case 'q':
+      quit(request, response);
+      break;
+    case 'p':
+      // Ping, measures the round trip
+      respond(request, response, SHM_SUCCESS_BYTE, 0);
+      break;
+    default:
+      respond(request, response, SHM_ERROR_BYTE, 0);
+      break;
+  }
+}
+
+static void respond(const MessageHeader *request, Message *response, uint8_t status, uint32_t length) {
+  response->header.version = PROTOCOL_VERSION;
+  response->header.opcode = status;
+  response->header.flags = 0;
+  response->header.clientId = request->clientId;
+  response->header.sequence = request->sequence;
+  response->header.length = length;
+}
+
+static void streamChunk(Stream *stream, Message *response) {
+  uint32_t count = stream->length - stream->sent;
+  if (count > SHM_MAX_PAYLOAD) {
+    count = SHM_MAX_PAYLOAD;
+  }
+  response->header = stream->header;
+  response->header.flags = stream->sent + count < stream->length ? MESSAGE_MORE : 0;
+  response->header.length = count;
+  memcpy(response->payload, stream->data + stream->sent, count);
+  stream->sent += count;
+}
+
+static int streamReserve(Stream *stream, uint32_t capacity) {
+  if (capacity <= stream->capacity) {
+    return 0;
+  }
+  if (capacity < 2 * stream->capacity) {
+    capacity = 2 * stream->capacity;
+  }
+  uint8_t *data = realloc(stream->data, capacity);
+  if (data == NULL) {
+    return -1;
+  }
+  stream->data = data;
+  stream->capacity = capacity;
+  return 0;
+}
+
+static Entry *entryAt(uint32_t index) {
+  Entry *entry = NULL;
+  pthread_mutex_lock(&registryLock);
+  if (index < registrySize) {
+    entry = &registry[index / REGISTRY_PAGE][index % REGISTRY_PAGE];
+  }
+  pthread_mutex_unlock(&registryLock);
+  return entry;
+}
+
+static Entry *findEntry(const MessageHeader *request) {
+  return lockEntry(request->clientId);
+}
+
+static Entry *lockEntry(uint32_t handle) {
+  Entry *entry = entryAt(handle & HANDLE_INDEX_MASK);
+  if (entry == NULL) {
+    return NULL;
+  }
+  pthread_mutex_lock(&entry->lock);
+  // The generation moved on once the client requested quit
+  if (entry->generation != handle >> HANDLE_INDEX_BITS || entry->sequence == NULL) {
+    pthread_mutex_unlock(&entry->lock);
+    return NULL;
+  }
+  return entry;
+}
+
+static Entry *findSealedEntry(const MessageHeader *request) {
+  Entry *entry = findEntry(request);
+  if (entry != NULL && !entry->sequence->sealed) {
+    pthread_mutex_unlock(&entry->lock);
+    return NULL;
+  }
+  return entry;
+}
+
+static Entry *registerMrna(Sequence *sequence, uint32_t *handle) {
+  pthread_mutex_lock(&registryLock);
+  uint32_t index = freeEntries;
+  if (index != HANDLE_INDEX_MASK) {
+    freeEntries = registry[index / REGISTRY_PAGE][index % REGISTRY_PAGE].nextFree;
+  } else {
+    // The last index is the end of the free list
+    if (registrySize == HANDLE_INDEX_MASK) {
+      pthread_mutex_unlock(&registryLock);
+      return NULL;
+    }
+    if (registrySize % REGISTRY_PAGE == 0) {
+      Entry *page = calloc(REGISTRY_PAGE, sizeof(Entry));
+      if (page == NULL) {
+        pthread_mutex_unlock(&registryLock);
+        return NULL;
+      }
+      for (uint32_t i = 0; i < REGISTRY_PAGE; i++) {
+        page[i].generation = 1;
+        page[i].position = registrySize + i;
+        pthread_mutex_init(&page[i].lock, NULL);
+      }
+      registry[registrySize / REGISTRY_PAGE] = page;
+    }
+    index = registrySize++;
+  }
+  Entry *entry = &registry[index / REGISTRY_PAGE][index % REGISTRY_PAGE];
+  pthread_mutex_unlock(&registryLock);
+
+  // Nobody finds the entry before its sequence is set
+  pthread_mutex_lock(&entry->lock);
+  entry->sequence = sequence;
+  entry->nextOrf = 0;
+  *handle = entry->generation << HANDLE_INDEX_BITS | index;
+  return entry;
+}
+
+static void releaseEntry(Entry *entry) {
+  releaseSequence(entry->sequence);
+  entry->sequence = NULL;
+  entry->generation = entry->generation % (HANDLE_GENERATIONS - 1) + 1;
+  pthread_mutex_lock(&registryLock);
+  entry->nextFree = freeEntries;
+  freeEntries = entry->position;
+  pthread_mutex_unlock(&registryLock);
+}
+
+static Sequence *newSequence(PackedMrna mrna) {
+  Sequence *sequence = calloc(1, sizeof(Sequence));
+  if (sequence == NULL) {
+    return NULL;
+  }
+  sequence->mrna = mrna;
+  sequence->references = 1;
+  pthread_mutex_init(&sequence->lock, NULL);
+  return sequence;
+}
+
+static Sequence *sealSequence(Sequence *sequence) {
+  sequence->hash = hashMrna(&sequence->mrna);
+  pthread_mutex_lock(&cacheLock);
+  Sequence *cached = cacheFind(sequence);
+  pthread_mutex_unlock(&cacheLock);
+  if (cached != NULL) {
+    freeSequence(sequence);
+    return cached;
+  }
+
+  // Index outside of the lock, then look again for a client which was
+  // faster with the same bases
+  if (buildOrfIndex(&sequence->mrna, &sequence->index) == -1) {
+    dropOrfIndex(&sequence->index);
+    return NULL;
+  }
+  pthread_mutex_lock(&cacheLock);
+  cached = cacheFind(sequence);
+  if (cached == NULL) {
+    if (cacheInsert(sequence) == -1) {
+      pthread_mutex_unlock(&cacheLock);
+      dropOrfIndex(&sequence->index);
+      return NULL;
     }
+    sequence->sealed = true;
+  }
+  pthread_mutex_unlock(&cacheLock);
+  if (cached != NULL) {
+    freeSequence(sequence);
+    return cached;
+  }
+  return sequence;
+}
+
+static void dropOrfIndex(OrfIndex *index) {
+  // Nothing is translated before sealing, there are no proteins to free
+  free(index->orfs);
+  index->orfs = NULL;
+  index->count = 0;
+  index->capacity = 0;
+}
 
-    // printf("Waiting for 3\n");
+static Sequence *cacheFind(const Sequence *sequence) {
+  if (cacheBuckets == 0) {
+    return NULL;
+  }
+  const PackedMrna *mrna = &sequence->mrna;
+  for (Sequence *cached = cache[sequence->hash & (cacheBuckets - 1)]; cached != NULL;
+       cached = cached->next) {
+    // Bits behind the last base are zero in both
+    if (cached->hash == sequence->hash && cached->mrna.length == mrna->length
+        && memcmp(cached->mrna.bases, mrna->bases, (mrna->length + 3) / 4) == 0) {
+      cached->references++;
+      return cached;
+    }
+  }
+  return NULL;
+}
 
-    // Wait for client to finish reading
-    if (sem_wait(sem3) != 0) {
-      // Let signal handler and atexit handle this
-      if (errno == EINTR) {
-        continue;
+static int cacheInsert(Sequence *sequence) {
+  if (cacheCount >= cacheBuckets) {
+    // Rehash into twice the buckets. Without memory the chains get longer.
+    uint32_t buckets = cacheBuckets == 0 ? 64 : 2 * cacheBuckets;
+    Sequence **table = calloc(buckets, sizeof(Sequence *));
+    if (table != NULL) {
+      for (uint32_t i = 0; i < cacheBuckets; i++) {
+        while (cache[i] != NULL) {
+          Sequence *moved = cache[i];
+          cache[i] = moved->next;
+          moved->next = table[moved->hash & (buckets - 1)];
+          table[moved->hash & (buckets - 1)] = moved;
+        }
       }
-      fprintf(stderr, "sem_wait failed\n");
-      exit(EXIT_FAILURE);
+      free(cache);
+      cache = table;
+      cacheBuckets = buckets;
+    } else if (cacheBuckets == 0) {
+      return -1;
+    }
+  }
+  Sequence **bucket = &cache[sequence->hash & (cacheBuckets - 1)];
+  sequence->next = *bucket;
+  *bucket = sequence;
+  cacheCount++;
+  return 0;
+}
+
+static void releaseSequence(Sequence *sequence) {
+  if (!sequence->sealed) {
+    // Only its submitting client knows it
+    freeSequence(sequence);
+    return;
+  }
+  pthread_mutex_lock(&cacheLock);
+  bool last = --sequence->references == 0;
+  if (last) {
+    Sequence **link = &cache[sequence->hash & (cacheBuckets - 1)];
+    while (*link != sequence) {
+      link = &(*link)->next;
     }
+    *link = sequence->next;
+    cacheCount--;
+  }
+  pthread_mutex_unlock(&cacheLock);
+  if (last) {
+    freeSequence(sequence);
+  }
+}
 
-    // printf("Posting 1\n");
+static void freeSequence(Sequence *sequence) {
+  free(sequence->mrna.bases);
+  for (uint32_t i = 0; i < sequence->index.count; i++) {
+    free(sequence->index.orfs[i].protein);
+  }
+  free(sequence->index.orfs);
+  pthread_mutex_destroy(&sequence->lock);
+  free(sequence);
+}
 
-    // We are done. Tell clients that they can send new requests now.
-    if (sem_post(sem1) != 0) {
-      fprintf(stderr, "sem_post failed\n");
-      exit(EXIT_FAILURE);
+static uint64_t hashMrna(const PackedMrna *mrna) {
+  // A word at a time, the padding behind the bases is zero
+  uint64_t hash = mrna->length * 0x9E3779B97F4A7C15ULL;
+  for (uint32_t base = 0; base < mrna->length; base += 32) {
+    hash = (hash ^ packedWord(mrna, base)) * 0xFF51AFD7ED558CCDULL;
+    hash ^= hash >> 32;
+  }
+  return hash;
+}
+
+static int buildOrfIndex(const PackedMrna *mrna, OrfIndex *index) {
+  uint32_t scan = 0;
+  while (true) {
+    uint32_t start = findStartCodon(mrna, scan);
+    if (start == mrna->length) {
+      return 0;
+    }
+    uint32_t stop = findStopCodon(mrna, start + 3);
+    if (stop == mrna->length) {
+      return 0;
+    }
+
+    if (index->count == index->capacity) {
+      uint32_t capacity = index->capacity == 0 ? 16 : 2 * index->capacity;
+      Orf *orfs = realloc(index->orfs, sizeof(Orf) * capacity);
+      if (orfs == NULL) {
+        return -1;
+      }
+      index->orfs = orfs;
+      index->capacity = capacity;
     }
+    Orf *orf = &index->orfs[index->count++];
+    orf->start = start + 3;
+    orf->end = stop;
+    orf->protein = NULL;
+
+    scan = stop + 3;
   }
+}
 
-  return EXIT_SUCCESS;
+static const uint8_t *orfProtein(Sequence *sequence, Orf *orf) {
+  // Other clients of the sequence may be translating it right now
+  uint8_t *protein = __atomic_load_n(&orf->protein, __ATOMIC_ACQUIRE);
+  if (protein != NULL) {
+    return protein;
+  }
+  pthread_mutex_lock(&sequence->lock);
+  protein = orf->protein;
+  if (protein == NULL) {
+    uint32_t codons = (orf->end - orf->start) / 3;
+    protein = malloc(codons + 1);
+    if (protein != NULL) {
+      // Always starts with AMINO_START, the stop codon is left out
+      protein[0] = AMINO_START;
+      translatePacked(&sequence->mrna, orf->start, codons, protein + 1);
+      __atomic_store_n(&orf->protein, protein, __ATOMIC_RELEASE);
+    }
+  }
+  pthread_mutex_unlock(&sequence->lock);
+  return protein;
 }
 
 static void createSharedMemory(void) {
-  int shmfd = shm_open(SHM_NAME, O_RDWR | O_CREAT, SHM_PERMISSION);
+  // Exclusive, a second server must not wipe the slots of a running one
+  int shmfd = shm_open(SHM_NAME, O_RDWR | O_CREAT | O_EXCL, SHM_PERMISSION);
   if (shmfd == -1) {
-    fprintf(stderr, "Shared memory allocation failed.\n");
+    if (errno == EEXIST) {
+      fprintf(stderr, "The server is already running.\n");
+    } else {
+      fprintf(stderr, "Shared memory allocation failed.\n");
+    }
     exit(EXIT_FAILURE);
   }
   if (ftruncate(shmfd, sizeof *sharedMemory) == -1) {
     fprintf(stderr, "ftrunctate failed\n");
+    shm_unlink(SHM_NAME);
     exit(EXIT_FAILURE);
   }
 
-  sharedMemory = mmap(NULL, sizeof *sharedMemory, PROT_READ | PROT_WRITE, MAP_SHARED, shmfd, 0);
+  SharedMemory *memory = mmap(NULL, sizeof *sharedMemory, PROT_READ | PROT_WRITE, MAP_SHARED, shmfd, 0);
 
-  if (sharedMemory == MAP_FAILED) {
+  if (memory == MAP_FAILED) {
     fprintf(stderr, "mmap failed\n");
+    shm_unlink(SHM_NAME);
     exit(EXIT_FAILURE);
   }
+  // From here on cleanup removes the segment again
+  sharedMemory = memory;
+
+  // The new segment is zero filled, every slot is free
+  for (uint32_t i = 0; i < SHM_SLOTS; i++) {
+    sharedMemory->slots[i].doorbell = i % workerCount;
+  }
 
   if (close(shmfd) == -1) {
     fprintf(stderr, "Closing the shared memory file failed.\n");
@@ -251,263 +984,341 @@ static void createSharedMemory(void) {
   }
 }
 
-static void createSemaphores(void) {
-  // Don't block so the first client can connect
-  sem1 = sem_open(SEM_1, O_CREAT | O_EXCL, 0600, 1);
-  if (sem1 == SEM_FAILED) {
-    fprintf(stderr, "sem_open failed\n");
-    exit(EXIT_FAILURE);
-  }
-  // Start with 0 so we block immediately while waiting for clients
-  sem2 = sem_open(SEM_2, O_CREAT | O_EXCL, 0600, 0);
-  if (sem2 == SEM_FAILED) {
-    fprintf(stderr, "sem_open failed\n");
-    exit(EXIT_FAILURE);
-  }
-
-  sem3 = sem_open(SEM_3, O_CREAT | O_EXCL, 0600, 0);
-  if (sem3 == SEM_FAILED) {
-    fprintf(stderr, "sem_open failed\n");
-    exit(EXIT_FAILURE);
-  }
-
-  sem4 = sem_open(SEM_4, O_CREAT | O_EXCL, 0600, 0);
-  if (sem4 == SEM_FAILED) {
-    fprintf(stderr, "sem_open failed\n");
-    exit(EXIT_FAILURE);
-  }}
-
 static void cleanup(void) {
   // printf("Cleaning up\n");
-  // Cleanup
+  // Cleanup, the segment may belong to another server if we never got it
+  if (sharedMemory == NULL) {
+    return;
+  }
   if (munmap(sharedMemory, sizeof *sharedMemory) == -1) {
     fprintf(stderr, "munmap failed\n");
   }
   if (shm_unlink(SHM_NAME) == -1) {
     fprintf(stderr, "shm_unlink failed\n");
   }
-  if (sem_close(sem1) == -1) {
-    fprintf(stderr, "sem_close failed\n");
-  }
-  if (sem_close(sem2) == -1) {
-    fprintf(stderr, "sem_close failed\n");
+
+  // Free everything, the workers are gone. The cache empties with the
+  // last entry.
+  for (uint32_t i = 0; i < registrySize; i++) {
+    Entry *entry = &registry[i / REGISTRY_PAGE][i % REGISTRY_PAGE];
+    if (entry->sequence != NULL) {
+      releaseEntry(entry);
+    }
   }
-  if (sem_close(sem3) == -1) {
-    fprintf(stderr, "sem_close failed\n");
+  free(cache);
+  for (uint32_t i = 0; i < registrySize; i += REGISTRY_PAGE) {
+    for (uint32_t j = 0; j < REGISTRY_PAGE; j++) {
+      pthread_mutex_destroy(&registry[i / REGISTRY_PAGE][j].lock);
+    }
+    free(registry[i / REGISTRY_PAGE]);
   }
-  if (sem_close(sem4) == -1) {
-    fprintf(stderr, "sem_close failed\n");
+  for (int i = 0; i < SHM_SLOTS; i++) {
+    free(streams[i].data);
   }
-  if (sem_unlink(SEM_1) == -1) {
-    fprintf(stderr, "sem_unlink failed\n");
+}
+
+static void submit(const MessageHeader *request, const uint8_t *payload, Message *response) {
+  PackedMrna mrna = { 0 };
+  if (appendMrna(&mrna, payload, request->length) == -1) {
+    // Failure
+    free(mrna.bases);
+    respond(request, response, SHM_ERROR_BYTE, 0);
+    return;
   }
-  if (sem_unlink(SEM_2) == -1) {
-    fprintf(stderr, "sem_unlink failed\n");
+
+  // Save globally
+  Sequence *sequence = newSequence(mrna);
+  if (sequence == NULL) {
+    free(mrna.bases);
+    respond(request, response, SHM_ERROR_BYTE, 0);
+    return;
   }
-  if (sem_unlink(SEM_3) == -1) {
-    fprintf(stderr, "sem_unlink failed\n");
+  uint32_t handle;
+  Entry *entry = registerMrna(sequence, &handle);
+  if (entry == NULL) {
+    freeSequence(sequence);
+    respond(request, response, SHM_ERROR_BYTE, 0);
+    return;
   }
-  if (sem_unlink(SEM_4) == -1) {
-    fprintf(stderr, "sem_unlink failed\n");
+  // A sequence of one chunk is complete already
+  if (!(request->flags & MESSAGE_MORE)) {
+    sequence = sealSequence(sequence);
+    if (sequence == NULL) {
+      releaseEntry(entry);
+      pthread_mutex_unlock(&entry->lock);
+      respond(request, response, SHM_ERROR_BYTE, 0);
+      return;
+    }
+    entry->sequence = sequence;
   }
+  pthread_mutex_unlock(&entry->lock);
 
-  // Free everything
-  free(mrnas);
-  free(mrnaPointers);
+  // Send client id and success
+  respond(request, response, SHM_SUCCESS_BYTE, 0);
+  response->header.clientId = handle;
 }
 
-static void submit(void) {
-  int finished = 0;
-  int i = 0;
-  while (!finished) {
-    if (i >= SHM_MAX_DATA) {
-      // Failure
-      resetSharedMemory();
-      sharedMemory->data[0] = SHM_ERROR_BYTE;
-      sharedMemory->data[1] = SHM_END_BYTE;
+static void append(const MessageHeader *request, const uint8_t *payload, Message *response) {
+  Entry *entry = findEntry(request);
+  if (entry == NULL) {
+    // Error
+    respond(request, response, SHM_ERROR_BYTE, 0);
+    return;
+  }
+  // A sealed sequence may be shared, it does not change any more
+  Sequence *sequence = entry->sequence;
+  if (sequence->sealed || appendMrna(&sequence->mrna, payload, request->length) == -1) {
+    pthread_mutex_unlock(&entry->lock);
+    respond(request, response, SHM_ERROR_BYTE, 0);
+    return;
+  }
+  if (!(request->flags & MESSAGE_MORE)) {
+    sequence = sealSequence(sequence);
+    if (sequence == NULL) {
+      // The last chunk failed, the handle is given up as in submit
+      releaseEntry(entry);
+      pthread_mutex_unlock(&entry->lock);
+      respond(request, response, SHM_ERROR_BYTE, 0);
       return;
     }
-    if (sharedMemory->data[i + 1] == SHM_END_BYTE) {
-      finished = 1;
-    }
-
-    i++;
+    entry->sequence = sequence;
   }
+  pthread_mutex_unlock(&entry->lock);
+
+  respond(request, response, SHM_SUCCESS_BYTE, 0);
+}
 
-  uint8_t *mrna = malloc((sizeof(uint8_t)) * i);
-  for (int j = 0; j < i; j++) {
-    mrna[j] = sharedMemory->data[j + 1];
+static void nextSequence(const MessageHeader *request, Message *response, Stream *stream) {
+  Entry *entry = findSealedEntry(request);
+  if (entry == NULL) {
+    // Error
+    respond(request, response, SHM_ERROR_BYTE, 0);
+    return;
+  }
+  Sequence *sequence = entry->sequence;
+  if (entry->nextOrf == sequence->index.count) {
+    pthread_mutex_unlock(&entry->lock);
+    respond(request, response, SHM_END_REACHED_BYTE, 0);
+    return;
   }
 
-  // Save globally
-  mrnaCount++;
-  if (mrnaCount == 0) {
-    mrnas = malloc(sizeof(uint8_t*));
-    mrnaPointers = malloc(sizeof(int));
-  } else {
-    mrnas = realloc(mrnas, (sizeof(uint8_t*)) * mrnaCount);
-    mrnaPointers = realloc(mrnaPointers, (sizeof(int)) * mrnaCount);
+  Orf *orf = &sequence->index.orfs[entry->nextOrf];
+  const uint8_t *protein = orfProtein(sequence, orf);
+  uint32_t length = (orf->end - orf->start) / 3 + 1;
+  if (protein == NULL || streamReserve(stream, 8 + length) == -1) {
+    pthread_mutex_unlock(&entry->lock);
+    respond(request, response, SHM_ERROR_BYTE, 0);
+    return;
   }
-  mrnas[mrnaCount - 1] = mrna;
-  mrnaPointers[mrnaCount - 1] = 0;
 
-  // Send client id and success
-  resetSharedMemory();
-  sharedMemory->data[0] = SHM_SUCCESS_BYTE;
-  sharedMemory->data[1] = mrnaCount - 1;
-  sharedMemory->data[2] = SHM_END_BYTE;
+  // Send the positions and the protein. It may be longer than a message.
+  memcpy(stream->data, &orf->start, sizeof orf->start);
+  memcpy(stream->data + 4, &orf->end, sizeof orf->end);
+  memcpy(stream->data + 8, protein, length);
+  stream->length = 8 + length;
+  stream->sent = 0;
+  respond(request, response, SHM_SUCCESS_BYTE, 0);
+  stream->header = response->header;
+  streamChunk(stream, response);
+
+  entry->nextOrf++;
+  pthread_mutex_unlock(&entry->lock);
 }
 
-static void nextSequence(void) {
-  uint8_t clientId = sharedMemory->data[1];
-  if (clientId >= mrnaCount) {
+static void batch(const MessageHeader *request, Message *response, Stream *stream) {
+  Entry *entry = findSealedEntry(request);
+  if (entry == NULL) {
     // Error
-    resetSharedMemory();
-    sharedMemory->data[0] = SHM_ERROR_BYTE;
-    sharedMemory->data[1] = SHM_END_BYTE;
+    respond(request, response, SHM_ERROR_BYTE, 0);
     return;
   }
+  const PackedMrna *mrna = &entry->sequence->mrna;
+  OrfIndex *index = &entry->sequence->index;
 
-  uint8_t start = 0;
-  uint8_t end = 0;
-
-  uint8_t *mrna = mrnas[clientId];
-  if (mrna == 0) {
-    // Error, client requested quit before.
-    resetSharedMemory();
-    sharedMemory->data[0] = SHM_ERROR_BYTE;
-    sharedMemory->data[1] = SHM_END_BYTE;
+  // The count, then start, end, length and protein of every frame
+  uint64_t length = 4;
+  for (uint32_t i = 0; i < index->count; i++) {
+    length += 12 + (index->orfs[i].end - index->orfs[i].start) / 3 + 1;
+  }
+  if (length > UINT32_MAX || streamReserve(stream, length) == -1) {
+    pthread_mutex_unlock(&entry->lock);
+    respond(request, response, SHM_ERROR_BYTE, 0);
     return;
   }
-  int pointer = mrnaPointers[clientId];
-  int running = 1;
-  while (running) {
-    uint8_t c = mrna[pointer];
-    if (c == SHM_END_BYTE) {
-      resetSharedMemory();
-      sharedMemory->data[0] = SHM_END_REACHED_BYTE;
-      sharedMemory->data[1] = SHM_END_BYTE;
-      return;
-    }
 
-    if (c == 'A') {
-      if (mrna[pointer + 1] != SHM_END_BYTE && mrna[pointer + 1] == 'U') {
-        if (mrna[pointer + 2] != SHM_END_BYTE && mrna[pointer + 2] == 'G') {
-          // Start!!!
-          pointer++;
-          pointer++;
-          start = pointer + 1;
-          running = false;
-        }
-      }
+  uint8_t *data = stream->data;
+  memcpy(data, &index->count, 4);
+  data += 4;
+  for (uint32_t i = 0; i < index->count; i++) {
+    Orf *orf = &index->orfs[i];
+    uint32_t proteinLength = (orf->end - orf->start) / 3 + 1;
+    memcpy(data, &orf->start, 4);
+    memcpy(data + 4, &orf->end, 4);
+    memcpy(data + 8, &proteinLength, 4);
+    data += 12;
+    // Frames no client requested with next yet are translated in place,
+    // not kept
+    const uint8_t *protein = __atomic_load_n(&orf->protein, __ATOMIC_ACQUIRE);
+    if (protein != NULL) {
+      memcpy(data, protein, proteinLength);
+    } else {
+      data[0] = AMINO_START;
+      translatePacked(mrna, orf->start, proteinLength - 1, data + 1);
     }
-
-    pointer++;
+    data += proteinLength;
   }
+  pthread_mutex_unlock(&entry->lock);
 
-  int aminosCount = 0;
-  uint8_t *aminos;
-
-  running = 1;
-  while (running) {
-    if (mrna[pointer] == SHM_END_BYTE || mrna[pointer + 1] == SHM_END_BYTE || mrna[pointer + 2] == SHM_END_BYTE) {
-        resetSharedMemory();
-        sharedMemory->data[0] = SHM_END_REACHED_BYTE;
-        sharedMemory->data[1] = SHM_END_BYTE;
-        return;
-    }
-    uint8_t f = mrna[pointer];
-    uint8_t s = mrna[pointer + 1];
-    uint8_t t = mrna[pointer + 2];
+  stream->length = length;
+  stream->sent = 0;
+  respond(request, response, SHM_SUCCESS_BYTE, 0);
+  stream->header = response->header;
+  streamChunk(stream, response);
+}
 
-    uint8_t amino = getAminoAcid(f, s, t);
-    if (amino == 0) {
-        resetSharedMemory();
-        sharedMemory->data[0] = SHM_ERROR_BYTE;
-        sharedMemory->data[1] = SHM_END_BYTE;
-        return;
-    }
+static void sixFrames(const MessageHeader *request, Message *response, Stream *stream) {
+  Entry *entry = findSealedEntry(request);
+  if (entry == NULL) {
+    // Error
+    respond(request, response, SHM_ERROR_BYTE, 0);
+    return;
+  }
+  const PackedMrna *mrna = &entry->sequence->mrna;
+  PackedMrna reverse;
+  if (reverseComplement(mrna, &reverse) == -1) {
+    pthread_mutex_unlock(&entry->lock);
+    respond(request, response, SHM_ERROR_BYTE, 0);
+    return;
+  }
 
-    if (amino == AMINO_STOP) {
-      // We reached the end. Lol.
-      end = pointer;
-      running = 0;
+  FrameScan scans[6];
+  memset(scans, 0, sizeof scans);
+  for (int f = 0; f < 6; f++) {
+    scans[f].mrna = f < 3 ? mrna : &reverse;
+    scans[f].frame = f % 3;
+  }
+  // Frames without a thread are scanned here
+  pthread_t threads[6];
+  bool started[6] = { false };
+  if (mrna->length >= PARALLEL_FRAMES_MIN) {
+    for (int f = 1; f < 6; f++) {
+      started[f] = pthread_create(&threads[f], NULL, scanFrame, &scans[f]) == 0;
     }
-
-    // Amino is something. Save it.
-    if (aminosCount == 0) {
-      aminos = malloc(sizeof(uint8_t));
+  }
+  for (int f = 0; f < 6; f++) {
+    if (started[f]) {
+      pthread_join(threads[f], NULL);
     } else {
-      aminos = realloc(aminos, sizeof(uint8_t) * aminosCount + 1);
+      scanFrame(&scans[f]);
     }
-    aminos[aminosCount] = amino;
-    aminosCount++;
-
-    pointer++;
-    pointer++;
-    pointer++;
+  }
+  pthread_mutex_unlock(&entry->lock);
+  free(reverse.bases);
+
+  // The records of the six frames one after the other
+  uint64_t length = 0;
+  bool failed = false;
+  for (int f = 0; f < 6; f++) {
+    length += scans[f].records.length;
+    failed = failed || scans[f].failed;
+  }
+  if (failed || length > UINT32_MAX || streamReserve(stream, length) == -1) {
+    for (int f = 0; f < 6; f++) {
+      free(scans[f].records.data);
+    }
+    respond(request, response, SHM_ERROR_BYTE, 0);
+    return;
+  }
+  stream->length = 0;
+  for (int f = 0; f < 6; f++) {
+    memcpy(stream->data + stream->length, scans[f].records.data, scans[f].records.length);
+    stream->length += scans[f].records.length;
+    free(scans[f].records.data);
   }
 
-  // We are finished. Send the response.
-  resetSharedMemory();
-  sharedMemory->data[0] = SHM_SUCCESS_BYTE;
-  sharedMemory->data[1] = start;
-  sharedMemory->data[2] = end;
-  // Always starts with AMINO_START
-  sharedMemory->data[3] = AMINO_START;
-  for (int i = 0; i < aminosCount; i++) {
-    sharedMemory->data[i + 4] = aminos[i];
+  stream->sent = 0;
+  respond(request, response, SHM_SUCCESS_BYTE, 0);
+  stream->header = response->header;
+  streamChunk(stream, response);
+}
+
+static void *scanFrame(void *argument) {
+  FrameScan *scan = argument;
+  const PackedMrna *mrna = scan->mrna;
+  Stream *records = &scan->records;
+  if (streamReserve(records, 4) == -1) {
+    scan->failed = true;
+    return NULL;
   }
-  sharedMemory->data[aminosCount - 1 + 4] = SHM_END_BYTE;
+  records->length = 4;
+
+  uint32_t count = 0;
+  uint32_t position = scan->frame;
+  while (true) {
+    uint32_t start = findFrameStartCodon(mrna, position);
+    if (start == mrna->length) {
+      break;
+    }
+    // Like next, a frame without a stop codon is left out
+    uint32_t stop = findStopCodon(mrna, start + 3);
+    if (stop == mrna->length) {
+      break;
+    }
 
-  // Save new pointer
-  mrnaPointers[clientId] = pointer;
+    uint32_t proteinLength = (stop - start - 3) / 3 + 1;
+    if ((uint64_t) records->length + 12 + proteinLength > UINT32_MAX
+        || streamReserve(records, records->length + 12 + proteinLength) == -1) {
+      scan->failed = true;
+      return NULL;
+    }
+    uint8_t *data = records->data + records->length;
+    uint32_t orfStart = start + 3;
+    memcpy(data, &orfStart, 4);
+    memcpy(data + 4, &stop, 4);
+    memcpy(data + 8, &proteinLength, 4);
+    data[12] = AMINO_START;
+    translatePacked(mrna, orfStart, proteinLength - 1, data + 13);
+    records->length += 12 + proteinLength;
+    count++;
+
+    position = stop + 3;
+  }
+  memcpy(records->data, &count, 4);
+  return NULL;
 }
 
-static void reset(void) {
-  uint8_t clientId = sharedMemory->data[1];
-  if (clientId >= mrnaCount) {
+static void reset(const MessageHeader *request, Message *response) {
+  Entry *entry = findEntry(request);
+  if (entry == NULL) {
     // Error
-    resetSharedMemory();
-    sharedMemory->data[0] = SHM_ERROR_BYTE;
-    sharedMemory->data[1] = SHM_END_BYTE;
+    respond(request, response, SHM_ERROR_BYTE, 0);
     return;
   }
 
-  // Reset the pointer
-  mrnaPointers[clientId] = 0;
+  // Back to the first reading frame
+  entry->nextOrf = 0;
+  pthread_mutex_unlock(&entry->lock);
+
+  respond(request, response, SHM_SUCCESS_BYTE, 0);
 }
 
-static void quit(void) {
-  uint8_t clientId = sharedMemory->data[1];
-  if (clientId >= mrnaCount) {
+static void quit(const MessageHeader *request, Message *response) {
+  Entry *entry = findEntry(request);
+  if (entry == NULL) {
     // Error
-    resetSharedMemory();
-    sharedMemory->data[0] = SHM_ERROR_BYTE;
-    sharedMemory->data[1] = SHM_END_BYTE;
+    respond(request, response, SHM_ERROR_BYTE, 0);
     return;
   }
 
-  // Reset the pointer
-  mrnaPointers[clientId] = 0;
-  // Reset mrna
-  uint8_t *mrna = mrnas[clientId];
-  if (mrna != 0) {
-    free(mrna);
-  }
-  mrnas[clientId] = 0;
-}
+  // Free the mrna, the handle is invalid from now on
+  releaseEntry(entry);
+  pthread_mutex_unlock(&entry->lock);
 
-static void resetSharedMemory(void) {
-  // Debugging. Should be irrelevant because of our
-  // SHM_END_BYTE constant.
-  for (int i = 0; i < SHM_MAX_DATA; i++) {
-    sharedMemory->data[i] = 0x00;
-  }
+  respond(request, response, SHM_SUCCESS_BYTE, 0);
 }
 
 static void usage(void) {
-  fprintf(stderr, "Usage: %s\n", programName);
+  fprintf(stderr, "Usage: %s [-w workers]\n", programName);
   exit(EXIT_FAILURE);
 }
 